@@ -0,0 +1,387 @@
+/*
+ *     Filename: delta.c
+ *  Description: Source file for packet classification algorithm
+ *               HyperSplit with a Tuple Space Search delta
+ *
+ *       Author: Nan Zhou
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+#include "hs.h"
+#include "tss.h"
+#include "utils.h"
+
+struct delta_conf delta_conf = {
+    4096,
+    64
+};
+
+static const unsigned int dim_bits[DIM_MAX] = {32, 32, 16, 16, 8};
+
+/* appends @num range rules to the ones held */
+static int hold_delta_rules(struct delta_clsfr *dc,
+        const struct rng_rule *rules, int num)
+{
+    struct rng_rule *grown;
+    int cap;
+
+    if (dc->rules.num + num > dc->rule_cap) {
+        cap = (dc->rules.num + num) << 1;
+        if ((grown = realloc(dc->rules.r_rules, cap * sizeof(*grown))) == NULL) {
+            return -1;
+        }
+        dc->rules.r_rules = grown;
+        dc->rule_cap = cap;
+    }
+    memcpy(&dc->rules.r_rules[dc->rules.num], rules, num * sizeof(*rules));
+    dc->rules.num += num;
+
+    return 0;
+}
+
+/* the prefix rule of a range rule whose ranges are all prefixes */
+static void rng2prfx_rule(struct prfx_rule *p, const struct rng_rule *r)
+{
+    uint32_t span;
+    int d;
+
+    bzero(p, sizeof(*p));
+    for (d = 0; d < DIM_MAX; d++) {
+        p->dim[d] = r->dim[d][0];
+        span = r->dim[d][1].u32 - r->dim[d][0].u32;
+        p->len[d] = dim_bits[d] - (span ? 32 - __builtin_clz(span) : 0);
+    }
+    p->pri = r->pri;
+
+    return;
+}
+
+/* adds @num range rules to the TSS, split into prefix rules */
+static int add_delta_tss(struct delta_clsfr *dc, const struct rng_rule *rules,
+        int num)
+{
+    struct rule_set prs = {NULL, NULL, 0};
+    struct rng_rule_head head;
+    struct rng_rule_node *node;
+    struct tss_space *ts;
+    int cap = 0, i, ret;
+
+    for (i = 0; i < num; i++) {
+        split_range_rule(&head, (struct rng_rule *)&rules[i]);
+        while (!STAILQ_EMPTY(&head)) {
+            node = STAILQ_FIRST(&head);
+            STAILQ_REMOVE_HEAD(&head, n);
+            if (prs.num == cap) {
+                cap = (cap + 64) << 1;
+                prs.p_rules = realloc(prs.p_rules, cap * sizeof(*prs.p_rules));
+                if (prs.p_rules == NULL) {
+                    perror("Cannot allocate memory for prefix rules");
+                    exit(-1);
+                }
+            }
+            rng2prfx_rule(&prs.p_rules[prs.num++], &node->r);
+            free(node);
+        }
+    }
+
+    ret = prs.num > 0 ? tss_build(&prs, &dc->delta) : 0;
+    SAFE_FREE(prs.p_rules);
+    if (ret != 0) {
+        return -1;
+    }
+
+    dc->delta_prfx += prs.num;
+    /* the tuples are sorted by their best priority */
+    if ((ts = dc->delta) != NULL && ts->num > 0) {
+        dc->delta_tuples = ts->num;
+        dc->delta_best = ts->tpls[0].highest_pri;
+    }
+
+    return 0;
+}
+
+static void cleanup_delta_tss(struct delta_clsfr *dc)
+{
+    if (dc->delta != NULL) {
+        tss_cleanup(&dc->delta);
+        dc->delta = NULL;
+    }
+    dc->delta_prfx = 0;
+    dc->delta_tuples = 0;
+
+    return;
+}
+
+/*
+ * background merge
+ */
+static int rng_rule_pri_cmp(const void *a, const void *b)
+{
+    return ((const struct rng_rule *)a)->pri - ((const struct rng_rule *)b)->pri;
+}
+
+static void *delta_merge_main(void *arg)
+{
+    struct delta_clsfr *dc = arg;
+    void *main = NULL;
+
+    /* a tree is built from rules in priority order */
+    qsort(dc->merge_rs.r_rules, dc->merge_rs.num,
+            sizeof(*dc->merge_rs.r_rules), rng_rule_pri_cmp);
+    if (hs_build(&dc->merge_rs, &main) != 0) {
+        main = NULL;
+    }
+    dc->merged = main;
+    __atomic_store_n(&dc->merge_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/* the delta is merged in the background once it is over a threshold */
+static int start_delta_merge(struct delta_clsfr *dc)
+{
+    int num = dc->rules.num - dc->main_num;
+
+    if (dc->merging || num == 0 ||
+            !((delta_conf.max_rules > 0 && num > delta_conf.max_rules) ||
+            (delta_conf.max_tuples > 0 &&
+             dc->delta_tuples > delta_conf.max_tuples))) {
+        return 0;
+    }
+
+    dc->merge_rs.r_rules = malloc(dc->rules.num * sizeof(*dc->rules.r_rules));
+    if (dc->merge_rs.r_rules == NULL) {
+        return -1;
+    }
+    memcpy(dc->merge_rs.r_rules, dc->rules.r_rules,
+            dc->rules.num * sizeof(*dc->rules.r_rules));
+    dc->merge_rs.num = dc->merge_num = dc->rules.num;
+    dc->merge_done = 0;
+    dc->merged = NULL;
+
+    if (pthread_create(&dc->merger, NULL, delta_merge_main, dc) != 0) {
+        SAFE_FREE(dc->merge_rs.r_rules);
+        return -1;
+    }
+    dc->merging = 1;
+    printf("merging %d delta rules in the background\n", num);
+
+    return 0;
+}
+
+/*
+ * swaps a finished merge in, the delta is built again from the rules
+ * added since the merge began. A failed merge leaves the pair as it was.
+ * The rules left may already call for the next merge.
+ */
+static int finish_delta_merge(struct delta_clsfr *dc)
+{
+    void *delta;
+    int prfx, tuples, best;
+
+    if (!dc->merging || !__atomic_load_n(&dc->merge_done, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    pthread_join(dc->merger, NULL);
+    dc->merging = 0;
+    SAFE_FREE(dc->merge_rs.r_rules);
+    if (dc->merged == NULL) {
+        fprintf(stderr, "Merging the delta failed\n");
+        return 0;
+    }
+
+    /* the new delta is built before the old pair goes */
+    delta = dc->delta;
+    prfx = dc->delta_prfx;
+    tuples = dc->delta_tuples;
+    best = dc->delta_best;
+    dc->delta = NULL;
+    dc->delta_prfx = 0;
+    dc->delta_tuples = 0;
+    if (add_delta_tss(dc, &dc->rules.r_rules[dc->merge_num],
+                dc->rules.num - dc->merge_num) != 0) {
+        cleanup_delta_tss(dc);
+        dc->delta = delta;
+        dc->delta_prfx = prfx;
+        dc->delta_tuples = tuples;
+        dc->delta_best = best;
+        hs_cleanup(&dc->merged);
+        return -1;
+    }
+    if (delta != NULL) {
+        tss_cleanup(&delta);
+    }
+
+    hs_cleanup(&dc->main);
+    dc->main = dc->merged;
+    dc->merged = NULL;
+    dc->main_num = dc->merge_num;
+    printf("delta merged: %d rules in the tree, %d left in the delta\n",
+            dc->main_num, dc->rules.num - dc->main_num);
+
+    return start_delta_merge(dc);
+}
+
+int delta_build(const struct rule_set *rs, void *userdata)
+{
+    struct delta_clsfr *dc;
+
+    if (rs->r_rules == NULL || (dc = calloc(1, sizeof(*dc))) == NULL) {
+        return -1;
+    }
+
+    if (hold_delta_rules(dc, rs->r_rules, rs->num) != 0 ||
+            hs_build(rs, &dc->main) != 0) {
+        SAFE_FREE(dc->rules.r_rules);
+        SAFE_FREE(dc);
+        *(struct delta_clsfr **) userdata = NULL;
+        return -1;
+    }
+    dc->main_num = rs->num;
+
+    *(struct delta_clsfr **) userdata = dc;
+    return 0;
+}
+
+int delta_insrt_update(const struct rule_set *rs, void *userdata)
+{
+    if (!*(void **) userdata || !rs->r_rules) return -1;
+    struct delta_clsfr *dc = *(typeof(dc) *)userdata;
+
+    if (finish_delta_merge(dc) != 0 ||
+            hold_delta_rules(dc, rs->r_rules, rs->num) != 0 ||
+            add_delta_tss(dc, rs->r_rules, rs->num) != 0) {
+        return -1;
+    }
+
+    printf("\ndelta_rules = %d", dc->rules.num - dc->main_num);
+    printf("\ndelta_prefix_rules = %d", dc->delta_prfx);
+    printf("\ndelta_tuples = %d\n", dc->delta_tuples);
+
+    return start_delta_merge(dc);
+}
+
+/*
+ * the delta is only probed if its best rule can beat what the tree found,
+ * lower priorities are better and -1 is no match
+ */
+static inline int delta_better(const struct delta_clsfr *dc, int pri)
+{
+    return dc->delta != NULL && (pri == -1 || dc->delta_best < pri);
+}
+
+int delta_classify(const struct packet *pkt, const void *userdata)
+{
+    const struct delta_clsfr *dc = *(typeof(dc) *)userdata;
+    int ret, pri;
+
+    ret = hs_classify(pkt, &dc->main);
+    if (delta_better(dc, ret)) {
+        pri = tss_classify(pkt, &dc->delta);
+        if (pri != -1 && (ret == -1 || pri < ret)) {
+            ret = pri;
+        }
+    }
+
+    return ret;
+}
+
+/* the packets the delta may win are gathered and classified as one burst */
+int delta_classify_burst(const struct packet *pkts, int n, int *res,
+        const void *userdata)
+{
+    const struct delta_clsfr *dc = *(typeof(dc) *)userdata;
+    struct packet probe[BURST_MAX];
+    int idx[BURST_MAX], pri[BURST_MAX];
+    int i, j, m;
+
+    hs_classify_burst(pkts, n, res, &dc->main);
+    if (dc->delta == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < n; ) {
+        for (m = 0; i < n && m < BURST_MAX; i++) {
+            if (delta_better(dc, res[i])) {
+                probe[m] = pkts[i];
+                idx[m++] = i;
+            }
+        }
+        if (m == 0) {
+            continue;
+        }
+        tss_classify_burst(probe, m, pri, &dc->delta);
+        for (j = 0; j < m; j++) {
+            if (pri[j] != -1 && (res[idx[j]] == -1 || pri[j] < res[idx[j]])) {
+                res[idx[j]] = pri[j];
+            }
+        }
+    }
+
+    return 0;
+}
+
+int delta_search(const struct trace *t, const void *userdata)
+{
+    struct delta_clsfr *dc = *(typeof(dc) *)userdata;
+    int i, m;
+    int res[BURST_MAX];
+
+    /* lookups take a merge that is done, they never wait for one */
+    if (finish_delta_merge(dc) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < t->num; i += BURST_MAX) {
+        m = t->num - i < BURST_MAX ? t->num - i : BURST_MAX;
+        delta_classify_burst(&t->pkts[i], m, res, userdata);
+    }
+
+    return 0;
+}
+
+void delta_cleanup(void *userdata)
+{
+    struct delta_clsfr *dc = *(typeof(dc) *)userdata;
+
+    if (dc == NULL) {
+        return;
+    }
+
+    if (dc->merging) {
+        pthread_join(dc->merger, NULL);
+        SAFE_FREE(dc->merge_rs.r_rules);
+        if (dc->merged != NULL) {
+            hs_cleanup(&dc->merged);
+        }
+    }
+    hs_cleanup(&dc->main);
+    cleanup_delta_tss(dc);
+    SAFE_FREE(dc->rules.r_rules);
+    SAFE_FREE(dc);
+    *(struct delta_clsfr **) userdata = NULL;
+
+    return;
+}
+
+/* the estimators look at the tree */
+int delta_build_estimate(const struct rule_set *rs, void *userdata)
+{
+    return hs_build_estimate(rs, userdata);
+}
+
+int delta_update_estimate(const struct rule_set *rs,
+        const struct rule_set *u_rs, void *userdata)
+{
+    struct delta_clsfr *dc = *(typeof(dc) *)userdata;
+
+    return hs_update_estimate(rs, u_rs, &dc->main);
+}
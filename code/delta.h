@@ -0,0 +1,61 @@
+/*
+ *     Filename: delta.h
+ *  Description: Header file for packet classification algorithm
+ *               HyperSplit with a Tuple Space Search delta
+ *
+ *       Author: Nan Zhou
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <pthread.h>
+#include "pc_eval.h"
+
+/*
+ * the rules are built into a HyperSplit tree, updates go into a small
+ * TSS next to it and a lookup takes the better of both. Once the TSS has
+ * grown too big or too slow, a thread builds a new tree of all rules
+ * while the old pair keeps classifying; rules added meanwhile stay in the
+ * TSS.
+ */
+struct delta_clsfr {
+    void *main;                 /* HyperSplit of rules[0, main_num) */
+    void *delta;                /* TSS of the rest, NULL if none */
+    struct rule_set rules;      /* all rules, in the order they came */
+    int rule_cap;
+    int main_num;
+    int delta_prfx;             /* prefix rules the delta rules became */
+    int delta_tuples;
+    int delta_best;             /* best priority in the delta */
+
+    /* merge in the background */
+    pthread_t merger;
+    int merging;
+    int merge_done;
+    struct rule_set merge_rs;   /* snapshot of the rules being built */
+    void *merged;
+    int merge_num;
+};
+
+struct delta_conf {
+    int max_rules;      /* rules in the delta before a merge, 0 for never */
+    int max_tuples;     /* tuples a lookup may probe before a merge, 0 for never */
+};
+
+extern struct delta_conf delta_conf;
+
+int delta_build(const struct rule_set *rs, void *userdata);
+int delta_insrt_update(const struct rule_set *rs, void *userdata);
+int delta_classify(const struct packet *pkt, const void *userdata);
+int delta_classify_burst(const struct packet *pkts, int n, int *res, const void *userdata);
+int delta_search(const struct trace *t, const void *userdata);
+void delta_cleanup(void *userdata);
+int delta_build_estimate(const struct rule_set *rs, void *userdata);
+int delta_update_estimate(const struct rule_set *rs, const struct rule_set *u_rs, void *userdata);
+
+#endif /* __DELTA_H__ */
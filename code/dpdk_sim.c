@@ -46,6 +46,9 @@
 #include <getopt.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include <rte_common.h>
 #include <rte_log.h>
@@ -160,9 +163,68 @@ static int64_t timer_period = 10 * TIMER_MILLISECOND * 1000; /* default period i
 
 struct platform_config {
     char *s_rule_file;
+    char *u_rule_file;  /* rules added by the control thread, NULL for none */
+    int update_delay;   /* seconds of forwarding before they are */
     int pc_algo;
 };
 
+/*
+ * classifier swaps: a worker picks rt up once per round of bursts and
+ * reports a quiescent state after it by copying the token. The control
+ * thread publishes a new classifier, bumps the token and frees the old one
+ * once every online worker has caught up with it. A quiescent state of 0
+ * is an offline worker.
+ */
+struct lcore_qsbr {
+    uint64_t qs;
+    uint64_t pkts;      /* classified, for the rates around a swap */
+} __rte_cache_aligned;
+static struct lcore_qsbr lcore_qsbr[RTE_MAX_LCORE];
+static uint64_t qsbr_token = 1;
+
+static inline void
+qsbr_online(struct lcore_qsbr *q)
+{
+    __atomic_store_n(&q->qs, __atomic_load_n(&qsbr_token, __ATOMIC_ACQUIRE),
+            __ATOMIC_RELAXED);
+    /* the token is out before rt is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void
+qsbr_offline(struct lcore_qsbr *q)
+{
+    __atomic_store_n(&q->qs, 0, __ATOMIC_RELEASE);
+}
+
+static inline void
+qsbr_quiescent(struct lcore_qsbr *q)
+{
+    __atomic_store_n(&q->qs, __atomic_load_n(&qsbr_token, __ATOMIC_ACQUIRE),
+            __ATOMIC_RELEASE);
+}
+
+/* waits until no worker can still hold a classifier swapped out before */
+static void
+qsbr_synchronize(void)
+{
+    uint64_t t, qs;
+    unsigned lcore_id;
+
+    t = __atomic_add_fetch(&qsbr_token, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+        for (;;) {
+            qs = __atomic_load_n(&lcore_qsbr[lcore_id].qs, __ATOMIC_ACQUIRE);
+            if (qs == 0 || qs >= t) {
+                break;
+            }
+            rte_delay_us(1);
+        }
+    }
+}
+
 /* Print out statistics on packets dropped */
 static void
 print_stats(void)
@@ -305,7 +367,7 @@ fwd_main_loop(int algo_id)
 	struct rte_mbuf *m;
 	int sent;
 	unsigned lcore_id;
-	int i, j, nb_rx;
+	int i, nb_rx;
     unsigned portid;
 	struct lcore_queue_conf *qconf;
 	struct rte_eth_dev_tx_buffer *buffer;
@@ -332,8 +394,14 @@ fwd_main_loop(int algo_id)
     struct packet *pkts = calloc(MAX_PKT_BURST, sizeof *pkts);
     /* int match_ids[MAX_PKT_BURST]; */
     int match_res[MAX_PKT_BURST];
+    struct lcore_qsbr *qsbr = &lcore_qsbr[lcore_id];
+    void *cur;
+
+    qsbr_online(qsbr);
 
     while (!force_quit) {
+        cur = __atomic_load_n(&rt, __ATOMIC_ACQUIRE);
+
 		/*
 		 * Read packet from RX queues
 		 */
@@ -348,16 +416,107 @@ fwd_main_loop(int algo_id)
 
                 prepare_packets(pkts_burst, pkts, nb_rx);
 
-                for (j = 0; j < nb_rx; j++) {
-                    match_res[j] = algrthms[algo_id].classify(&pkts[j], &rt);
-                    //print_packet(pkts[j]);
-                    //printf("match %d\n", match_res[j]);
-                }
+                algrthms[algo_id].classify_burst(pkts, nb_rx, match_res, &cur);
+                __atomic_store_n(&qsbr->pkts, qsbr->pkts + nb_rx,
+                        __ATOMIC_RELAXED);
 
                 send_packets(pkts_burst, match_res, nb_rx, dst_port);
             }
 		}
+
+        qsbr_quiescent(qsbr);
 	}
+
+    qsbr_offline(qsbr);
+    free(pkts);
+}
+
+/* per-lcore classifying rates since @last, which is brought up to now */
+static void
+print_lcore_rates(const char *phase, uint64_t *last, uint64_t *last_tsc)
+{
+    uint64_t tsc = rte_rdtsc(), pkts;
+    double secs = (double)(tsc - *last_tsc) / rte_get_tsc_hz();
+    unsigned lcore_id;
+
+    RTE_LCORE_FOREACH(lcore_id) {
+        if (lcore_queue_conf[lcore_id].n_rx_port == 0)
+            continue;
+        pkts = __atomic_load_n(&lcore_qsbr[lcore_id].pkts, __ATOMIC_RELAXED);
+        printf("lcore %u %s: %.3f Mpps\n", lcore_id, phase,
+                secs > 0 ? (pkts - last[lcore_id]) / secs / 1e6 : 0);
+        last[lcore_id] = pkts;
+    }
+    *last_tsc = tsc;
+}
+
+/*
+ * control thread: after the delay, builds the rules with the updates off
+ * the data path, swaps the new classifier in and frees the old one after
+ * a grace period
+ */
+static void *
+control_main(void *arg)
+{
+    struct platform_config *p_plat_cfg = arg;
+    const struct algo_t *algo = &algrthms[p_plat_cfg->pc_algo];
+    struct rule_set rs = {NULL, NULL, 0}, u_rs = {NULL, NULL, 0};
+    uint64_t last[RTE_MAX_LCORE] = {0}, last_tsc, timediff;
+    struct timeval starttime, stoptime;
+    void *next = NULL, *old;
+    int i;
+
+    for (i = 0; i < p_plat_cfg->update_delay * 10 && !force_quit; i++)
+        usleep(100000);
+    if (force_quit)
+        return NULL;
+
+    algo->load_rules(&rs, p_plat_cfg->s_rule_file);
+    algo->load_rules(&u_rs, p_plat_cfg->u_rule_file);
+    if (rs.num + u_rs.num > RULE_MAX) {
+        fprintf(stderr, "Too many rules with the updates\n");
+        goto out;
+    }
+    if (rs.r_rules != NULL)
+        memcpy(&rs.r_rules[rs.num], u_rs.r_rules,
+                u_rs.num * sizeof(*rs.r_rules));
+    if (rs.p_rules != NULL)
+        memcpy(&rs.p_rules[rs.num], u_rs.p_rules,
+                u_rs.num * sizeof(*rs.p_rules));
+    rs.num += u_rs.num;
+
+    last_tsc = rte_rdtsc();
+    print_lcore_rates("before update", last, &last_tsc);
+    usleep(1000000);
+    print_lcore_rates("before update", last, &last_tsc);
+
+    printf("Rebuilding with %d updates\n", u_rs.num);
+    gettimeofday(&starttime, NULL);
+    if (algo->build(&rs, &next) != 0) {
+        fprintf(stderr, "Rebuilding failed\n");
+        goto out;
+    }
+    gettimeofday(&stoptime, NULL);
+    timediff = make_timediff(&starttime, &stoptime);
+    printf("Time for rebuilding: %"PRIu64"(us)\n", timediff);
+    print_lcore_rates("while rebuilding", last, &last_tsc);
+
+    old = __atomic_exchange_n(&rt, next, __ATOMIC_RELEASE);
+    gettimeofday(&starttime, NULL);
+    qsbr_synchronize();
+    gettimeofday(&stoptime, NULL);
+    timediff = make_timediff(&starttime, &stoptime);
+    printf("Grace period: %"PRIu64"(us)\n", timediff);
+    print_lcore_rates("while swapping", last, &last_tsc);
+
+    algo->cleanup(&old);
+    usleep(1000000);
+    print_lcore_rates("after update", last, &last_tsc);
+
+out:
+    unload_rules(&rs);
+    unload_rules(&u_rs);
+    return NULL;
 }
 
 static int
@@ -375,7 +534,11 @@ l2fwd_usage(const char *prgname)
 	printf("%s [EAL options] -- -p PORTMASK [-q NQ]\n"
 	       "  -p PORTMASK: hexadecimal bitmask of ports to configure\n"
 	       "  -q NQ: number of queue (=ports) per lcore (default is 1)\n"
-		   "  -T PERIOD: statistics will be refreshed each PERIOD seconds (0 to disable, 10 default, 86400 maximum)\n",
+		   "  -T PERIOD: statistics will be refreshed each PERIOD seconds (0 to disable, 10 default, 86400 maximum)\n"
+	       "  -r FILE: rules to build the classifier from\n"
+	       "  -a ID: algorithm, 0:HyperSplit, 1:TSS\n"
+	       "  -u FILE: rules the control thread adds while forwarding\n"
+	       "  -U DELAY: seconds of forwarding before they are added (default is 5)\n",
 	       prgname);
 }
 
@@ -444,7 +607,7 @@ l2fwd_parse_args(struct platform_config *p_plat_cfg, int argc, char **argv)
 
 	argvopt = argv;
 
-	while ((opt = getopt_long(argc, argvopt, "p:q:T:r:a:",
+	while ((opt = getopt_long(argc, argvopt, "p:q:T:r:a:u:U:",
 				  lgopts, &option_index)) != EOF) {
 
 	switch (opt) {
@@ -487,6 +650,15 @@ l2fwd_parse_args(struct platform_config *p_plat_cfg, int argc, char **argv)
             assert(p_plat_cfg->pc_algo > ALGO_INV && p_plat_cfg->pc_algo < ALGO_NUM);
             break;
 
+        case 'u':
+            p_plat_cfg->u_rule_file = optarg;
+            break;
+
+        case 'U':
+            p_plat_cfg->update_delay = atoi(optarg);
+            assert(p_plat_cfg->update_delay >= 0);
+            break;
+
 		/* long options */
 		case 0:
 			l2fwd_usage(prgname);
@@ -596,8 +768,11 @@ main(int argc, char **argv)
     };
     struct platform_config plat_cfg = {
         .s_rule_file = NULL,
+        .u_rule_file = NULL,
+        .update_delay = 5,
         .pc_algo = ALGO_INV,
     };
+    pthread_t control;
 
 	/* init EAL */
 	ret = rte_eal_init(argc, argv);
@@ -795,6 +970,11 @@ main(int argc, char **argv)
 	check_all_ports_link_status(nb_ports, l2fwd_enabled_port_mask);
 
 	ret = 0;
+    /* updates are built and swapped in off the lcores */
+    if (plat_cfg.u_rule_file != NULL &&
+            pthread_create(&control, NULL, control_main, &plat_cfg) != 0)
+        rte_exit(EXIT_FAILURE, "Cannot start the control thread\n");
+
 	/* launch per-lcore init on every lcore */
 	/* rte_eal_mp_remote_launch(l2fwd_launch_one_lcore, NULL, CALL_MASTER); */
     rte_eal_mp_remote_launch(l2fwd_launch_one_lcore, (void *)(&plat_cfg), CALL_MASTER);
@@ -804,6 +984,9 @@ main(int argc, char **argv)
 			break;
 		}
 	}
+    if (plat_cfg.u_rule_file != NULL)
+        pthread_join(control, NULL);
+    algrthms[plat_cfg.pc_algo].cleanup(&rt);
 
 	for (portid = 0; portid < nb_ports; portid++) {
 		if ((l2fwd_enabled_port_mask & (1 << portid)) == 0)
@@ -19,54 +19,326 @@
 #include <sys/queue.h>
 #include <time.h>
 #include <math.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
 #include "hs.h"
 #include "utils.h"
+#include "uthash.h"
 
-/* we need a stack to traverse k-d tree */
-struct s_node {
-    struct rng_rule r;
-    struct hs_node *p_tn;
-    STAILQ_ENTRY(s_node) entry;
+struct seg_point {
+    union point pnt;
+    struct { uint8_t begin :1; uint8_t end :1; } flag;
 };
 
-STAILQ_HEAD(s_head, s_node);
+/*
+ * the rules reaching a node: indices into the rule set being built, no
+ * index array meaning all of it. A rule is cut to the box of the region
+ * whenever it is read, so children never copy rules. ends[d] lists the
+ * bounds on d in ascending order, rule i << 1 | 1 for its high one.
+ */
+struct hs_region {
+    const struct rule_set *rs;
+    int num;
+    const int *idx;
+    const int *ends[DIM_MAX];
+    union point box[DIM_MAX][2];
+};
 
-struct seg_point {
+/* ints a region takes per rule: its index and its bounds */
+#define HS_REGION_INTS (1 + DIM_MAX * 2)
+
+#define REGION_RULE(rg, i) \
+    (&(rg)->rs->r_rules[(rg)->idx != NULL ? (rg)->idx[i] : (i)])
+
+/*
+ * bound @b, 0 for the low one, of rule @i on @d within the region. This is
+ * read for every rule at every node, so the compare is open coded rather
+ * than a call to is_less()/is_greater().
+ */
+static inline union point region_pnt(const struct hs_region *rg, int i,
+        int d, int b)
+{
+    const union point *p = &REGION_RULE(rg, i)->dim[d][b];
+    const union point *edge = &rg->box[d][b];
+    const union point *x = b == 0 ? p : edge, *y = b == 0 ? edge : p;
+
+    if (x->u128.high < y->u128.high || (x->u128.high == y->u128.high &&
+                x->u128.low < y->u128.low)) {
+        return *edge;
+    }
+
+    return *p;
+}
+
+/* the whole of @rs, unbounded */
+static void init_hs_region(struct hs_region *rg, const struct rule_set *rs)
+{
+    int d;
+
+    rg->rs = rs;
+    rg->num = rs->num;
+    rg->idx = NULL;
+    for (d = 0; d < DIM_MAX; d++) {
+        rg->ends[d] = NULL;
+        rg->box[d][0].u128.low = rg->box[d][0].u128.high = 0;
+        rg->box[d][1].u128.low = rg->box[d][1].u128.high = UINT64_MAX;
+    }
+
+    return;
+}
+
+/* a rule bound while the root sorts them */
+struct hs_end {
     union point pnt;
-    struct { uint8_t begin :1; uint8_t end :1; } flag;
+    int end;
 };
 
-static struct {
-    size_t segment_num[DIM_MAX];
-    size_t segment_total;
+static int hs_end_cmp(const void *a, const void *b)
+{
+    const union point *pa = &((const struct hs_end *)a)->pnt;
+    const union point *pb = &((const struct hs_end *)b)->pnt;
+
+    if (pa->u128.high != pb->u128.high) {
+        return pa->u128.high < pb->u128.high ? -1 : 1;
+    }
+
+    return pa->u128.low < pb->u128.low ? -1 : pa->u128.low > pb->u128.low;
+}
+
+/*
+ * sort the bounds of @rg into @ends, rg->num * 2 per dim. This is the only
+ * sort of a build: children filter the lists of their parent, and cutting
+ * the bounds to a smaller box keeps them in order.
+ */
+static int sort_hs_region(struct hs_region *rg, int *ends)
+{
+    struct hs_end *sorted;
+    int num = rg->num << 1, d, i;
 
-    size_t worst_depth;
-    size_t average_depth;
+    if ((sorted = malloc(num * sizeof(*sorted))) == NULL) {
+        return -1;
+    }
 
-    size_t tree_node_num;
-    size_t leaf_node_num;
+    for (d = 0; d < DIM_MAX; d++, ends += num) {
+        for (i = 0; i < num; i++) {
+            sorted[i].pnt = region_pnt(rg, i >> 1, d, i & 1);
+            sorted[i].end = i;
+        }
+        qsort(sorted, num, sizeof(*sorted), hs_end_cmp);
+        for (i = 0; i < num; i++) {
+            ends[i] = sorted[i].end;
+        }
+        rg->ends[d] = ends;
+    }
 
-    /* TODO: assume max_depth = 128 */
-    size_t depth_node[128][2];
-} g_statistics;
+    free(sorted);
+    return 0;
+}
 
-static struct {
+struct hs_build_estimator {
     float overlap_density[DIM_MAX];
     size_t distribute[DIM_MAX];
     int segment_sum;
-    int choose[DIM_MAX];
-    size_t avg_choose_depth;
-    size_t choose_num;
-//    struct seg_point seg_pnts[999999];
-    float avg_density;
-} build_estimator;
-
-static struct {
+};
+
+struct hs_update_estimator {
     float overlap_density[DIM_MAX];
     size_t distribute[DIM_MAX];
     int meet[DIM_MAX];
     size_t meet_num;
-} update_estimator;
+};
+
+/*
+ * counters bumped while building. Pool workers point them at their own
+ * copy, merged into the tree's when the pool stops, the thread that
+ * started the build at the tree's.
+ */
+static __thread struct hs_stats *t_stats;
+
+/* best effort: depths the histogram can't grow to are left out of it */
+static int grow_hs_depth(struct hs_stats *st, size_t depth)
+{
+    size_t cap, *node;
+    int i;
+
+    for (cap = st->depth_cap ? st->depth_cap : 64; cap <= depth; cap <<= 1);
+    for (i = 0; i < 2; i++) {
+        if ((node = realloc(st->depth_node[i], cap * sizeof(*node))) == NULL) {
+            return -1;
+        }
+        bzero(node + st->depth_cap, (cap - st->depth_cap) * sizeof(*node));
+        st->depth_node[i] = node;
+    }
+    st->depth_cap = cap;
+
+    return 0;
+}
+
+static void count_hs_depth(struct hs_stats *st, size_t depth, int leaf,
+        long num)
+{
+    if (depth < st->depth_cap || grow_hs_depth(st, depth) == 0) {
+        st->depth_node[leaf][depth] += num;
+    }
+
+    return;
+}
+
+static void free_hs_stats(struct hs_stats *st)
+{
+    SAFE_FREE(st->depth_node[0]);
+    SAFE_FREE(st->depth_node[1]);
+    st->depth_cap = 0;
+
+    return;
+}
+
+/* adds what a pool worker counted to @dst and releases it */
+static void merge_hs_stats(struct hs_stats *dst, struct hs_stats *src)
+{
+    size_t d;
+
+    if (dst->worst_depth < src->worst_depth) {
+        dst->worst_depth = src->worst_depth;
+    }
+    dst->average_depth += src->average_depth;
+    dst->tree_node_num += src->tree_node_num;
+    dst->leaf_node_num += src->leaf_node_num;
+    for (d = 0; d < src->depth_cap; d++) {
+        count_hs_depth(dst, d, 0, src->depth_node[0][d]);
+        count_hs_depth(dst, d, 1, src->depth_node[1][d]);
+    }
+    dst->shared_num += src->shared_num;
+    dst->bucket_num += src->bucket_num;
+    dst->bucket_rules += src->bucket_rules;
+    dst->bucket_forced += src->bucket_forced;
+    dst->bucket_memory += src->bucket_memory;
+    for (d = 0; d < DIM_MAX; d++) {
+        dst->choose[d] += src->choose[d];
+    }
+    dst->choose_num += src->choose_num;
+    dst->choose_depth += src->choose_depth;
+    free_hs_stats(src);
+
+    return;
+}
+
+/*
+ * build task pool: every worker keeps the tasks it spawns in a deque,
+ * runs the newest one itself and steals the oldest one of another worker
+ * when it runs dry, so the biggest pending subtrees are the ones spread.
+ * A task is waited for by running other tasks until it is done.
+ */
+#define HS_TASK_RULES 256       /* smaller rule sets are built serially */
+#define HS_DIM_TASK_RULES 8192  /* larger ones also scan dims in parallel */
+#define HS_DEQUE_MAX 256
+
+struct hs_task {
+    void (*run)(struct hs_task *);
+    int done;
+};
+
+struct hs_worker {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    struct hs_task *deque[HS_DEQUE_MAX];
+    int head, tail;
+    unsigned int seed;
+    struct hs_build *build;
+    struct hs_stats stats;
+    struct hs_arena arena;
+};
+
+static __thread struct hs_worker *t_worker;
+
+#define HS_CHUNK_SIZE (256 << 10)
+
+struct hs_chunk {
+    struct hs_chunk *next;
+    size_t used;
+    size_t size;
+    char mem[] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/* where the thread building puts nodes: the tree, or its pool worker */
+static __thread struct hs_arena *t_arena;
+
+/*
+ * scratch buffers of build_hs_tree, one level per call on the thread.
+ * Tasks run while waiting nest on top, so a level is never shared. The
+ * levels only grow, which makes a build allocate O(depth) buffers.
+ */
+struct hs_scratch {
+    int *wght;
+    struct seg_point *seg_pnts;
+    int pnt_cap;
+    int *idx[2];                /* the second for a left child on the pool */
+    int idx_cap[2];
+};
+
+static __thread struct hs_scratch **t_scratch;
+static __thread int t_scratch_num, t_scratch_top;
+
+/*
+ * trimmed rule sets already built into a subtree. The subtree only tests
+ * dimensions in which some rule is narrower than the set, so the set is
+ * identified by the priorities plus the trimmed ranges in those dimensions
+ * as long as priorities are unique. Two disjoint regions holding the same
+ * rules then share one subtree.
+ */
+struct hs_subtree {
+    uint64_t sig;
+    int num;
+    int *pri;
+    uint32_t *key;              /* num * DIM_MAX * 2 ranges, 0 if not tested */
+    struct hs_node *node;
+    struct hs_subtree *next;    /* same sig */
+    UT_hash_handle hh;
+};
+
+/*
+ * state of one build, shared by the threads working on it. Workers reach
+ * it through their hs_worker, so separate builds can run side by side.
+ * The memory budget is checked against all workers at once.
+ */
+struct hs_build {
+    struct hs_worker *workers;
+    int worker_num;
+    int stop;
+    struct hs_subtree *subtree_tbl;
+    pthread_mutex_t subtree_lock;
+    int subtree_dedup;
+    size_t memory;
+};
+
+static __thread struct hs_build *t_build;
+
+/* node to its compiled index, for subtrees reached from several parents */
+struct hs_node_map {
+    struct hs_node *node;
+    uint32_t idx;
+    UT_hash_handle hh;
+};
+
+struct hs_conf hs_conf = {
+    HS_LAYOUT_FLAT,
+    HS_SIMD_AUTO,
+    HS_WIDE_LEVELS,
+    1,
+    1,
+    0,
+    0,
+    1,
+    0,
+    0
+};
+
+/* packet fields are gathered as 32-bit words relative to the packet */
+#define PKT_WORDS (sizeof(struct packet) / sizeof(uint32_t))
+#define PNT_WORDS (sizeof(union point) / sizeof(uint32_t))
+
+static void select_hs_kernel(struct hs_tree *tree);
 
 static int seg_pnt_cmp(const void *a, const void *b)
 {
@@ -82,523 +354,3286 @@ static int seg_pnt_cmp(const void *a, const void *b)
     }
 }
 
-
-static int build_hs_tree(
-        const struct rule_set *rs, struct hs_node *cur_node, int depth)
+/* first of the @num sorted points above @pnt, or not below it if !@upper */
+static int seg_pnt_bound(const struct seg_point *seg_pnts, int num,
+        const union point *pnt, int upper)
 {
-    int *wght, wght_all;
-    float wght_avg, wght_jdg;
-    int max_pnt, num, pnt_num, d2s, d, i, j;
-
-    union point thresh;
-    struct rule_set child_rs;
-    struct seg_point *seg_pnts;
-    struct range lrange, rrange;
+    int lo = 0, hi = num, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (upper ? is_greater((union point *)&seg_pnts[mid].pnt,
+                    (union point *)pnt) :
+                !is_less((union point *)&seg_pnts[mid].pnt,
+                    (union point *)pnt)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
 
-    max_pnt = d2s = 0;
-    num = rs->num << 1;
-    wght_avg = rs->num + 1; //max, all rules project one segment
+    return lo;
+}
 
-    bzero(&lrange, sizeof(lrange));
-    bzero(&rrange, sizeof(rrange));
+/* turn the marks where runs begin and end into rules per segment */
+static int sum_seg_wght(int *wght, int pnt_num)
+{
+    int wght_all, i;
 
-    wght = malloc(num * sizeof(*wght));
-    seg_pnts  = malloc(num * sizeof(*seg_pnts));
-    child_rs.r_rules = malloc(rs->num * sizeof(*child_rs.r_rules));
-    if (wght == NULL || seg_pnts == NULL || child_rs.r_rules == NULL) {
-        SAFE_FREE(wght);
-        SAFE_FREE(seg_pnts);
-        SAFE_FREE(child_rs.r_rules);
-        return -1;
+    for (wght_all = 0, i = 0; i < pnt_num - 1; i++) {
+        if (i > 0) {
+            wght[i] += wght[i - 1];
+        }
+        wght_all += wght[i];
     }
 
-    /*
-     * start here
-     */
-    for (d = 0; d < DIM_MAX; d++) {
-        bzero(wght, num * sizeof(*wght));
-        bzero(seg_pnts, num * sizeof(*seg_pnts));
+    return wght_all;
+}
 
-        /*
-         * shadow rules on each dim
-         */
-        for (i = 0; i < num; i += 2) {
-            seg_pnts[i].pnt = rs->r_rules[i >> 1].dim[d][0];
-            seg_pnts[i].flag.begin = 1;
-            seg_pnts[i + 1].pnt = rs->r_rules[i >> 1].dim[d][1];
-            seg_pnts[i + 1].flag.end = 1;
+/*
+ * count in wght[i] the rules of @rg covering segment i of dimension @d,
+ * [seg_pnts[i], seg_pnts[i + 1]]. A rule covers a run of segments, so it
+ * only marks where the run begins and ends, and one prefix sum over the
+ * marks gives the counts: O(n log n) instead of segments * rules.
+ */
+static int gen_seg_wght(const struct hs_region *rg, int d,
+        const struct seg_point *seg_pnts, int pnt_num, int *wght)
+{
+    union point lo, hi;
+    int begin, end, i;
+
+    bzero(wght, pnt_num * sizeof(*wght));
+
+    for (i = 0; i < rg->num; i++) {
+        lo = region_pnt(rg, i, d, 0);
+        hi = region_pnt(rg, i, d, 1);
+        begin = seg_pnt_bound(seg_pnts, pnt_num, &lo, 0);
+        end = seg_pnt_bound(seg_pnts, pnt_num, &hi, 1) - 1;
+        if (begin < end) {
+            wght[begin]++;
+            wght[end]--;
         }
+    }
 
-        qsort(seg_pnts, num, sizeof(*seg_pnts), seg_pnt_cmp);
+    return sum_seg_wght(wght, pnt_num);
+}
 
-        /*
-         * make segments. Note: pnts with the same val may form one seg
-         *                Deal with the same val condition
-         *                Compact the seg_pnts
-         */
-        for (pnt_num = 0, i = pnt_num + 1; i < num; i++) {
-            //for loop used to scan two indexes
-            //pnt_num increases conditionally, i increases directly
-            //pnt_num increases in the loops according to some condition
-            //i increases every loop
-            if (is_equal(&seg_pnts[pnt_num].pnt, &seg_pnts[i].pnt)) {
-                seg_pnts[pnt_num].flag.begin |= seg_pnts[i].flag.begin;
-                seg_pnts[pnt_num].flag.end |= seg_pnts[i].flag.end;
 
-                if (i + 1 != num) {
-                    //when i is not the end, go to the next loop
-                    //pnt_num doesn't increase
-                    continue;
-                }
+#define KEY_WORDS (DIM_MAX * 2)
 
-                if (seg_pnts[pnt_num].flag.begin & seg_pnts[pnt_num].flag.end) {
-                    seg_pnts[pnt_num + 1] = seg_pnts[pnt_num];
-                    seg_pnts[pnt_num++].flag.end = 0;
-                    seg_pnts[pnt_num].flag.begin = 0;
-                }
+static uint32_t *sign_rule_set(const struct hs_region *rg, uint64_t *sig)
+{
+    uint32_t box[DIM_MAX][2], *key, *k;
+    int tested[DIM_MAX];
+    int i, d;
+
+    if ((key = calloc(rg->num * KEY_WORDS, sizeof(*key))) == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < rg->num; i++) {
+        for (d = 0; d < DIM_MAX; d++) {
+            key[i * KEY_WORDS + d * 2] = region_pnt(rg, i, d, 0).u32;
+            key[i * KEY_WORDS + d * 2 + 1] = region_pnt(rg, i, d, 1).u32;
+        }
+    }
 
+    for (d = 0; d < DIM_MAX; d++) {
+        box[d][0] = UINT32_MAX;
+        box[d][1] = 0;
+        for (i = 0; i < rg->num; i++) {
+            k = &key[i * KEY_WORDS + d * 2];
+            if (k[0] < box[d][0]) {
+                box[d][0] = k[0];
+            }
+            if (k[1] > box[d][1]) {
+                box[d][1] = k[1];
+            }
+        }
+
+        tested[d] = 0;
+        for (i = 0; i < rg->num; i++) {
+            k = &key[i * KEY_WORDS + d * 2];
+            if (k[0] != box[d][0] || k[1] != box[d][1]) {
+                tested[d] = 1;
                 break;
             }
+        }
+    }
 
-            //the following statements only work
-            //when seg_pnts[pnt_num] is unequal to seg_pnts[i] or i == num-1
-            //when the former if is true, this if is true possibly
-            if (seg_pnts[pnt_num].flag.begin & seg_pnts[pnt_num].flag.end) {
-                seg_pnts[pnt_num + 1] = seg_pnts[pnt_num];
-                seg_pnts[pnt_num++].flag.end = 0;
-                seg_pnts[pnt_num].flag.begin = 0;
+    *sig = 14695981039346656037ULL;
+    for (i = 0; i < rg->num; i++) {
+        *sig = (*sig ^ (uint32_t)REGION_RULE(rg, i)->pri) * 1099511628211ULL;
+        for (d = 0; d < DIM_MAX; d++) {
+            k = &key[i * KEY_WORDS + d * 2];
+            if (!tested[d]) {
+                k[0] = k[1] = 0;
+                continue;
             }
+            *sig = (*sig ^ k[0]) * 1099511628211ULL;
+            *sig = (*sig ^ k[1]) * 1099511628211ULL;
+        }
+    }
 
-            seg_pnts[++pnt_num] = seg_pnts[i];
+    return key;
+}
+
+static struct hs_subtree *find_hs_subtree(const struct hs_region *rg,
+        uint64_t sig, const uint32_t *key)
+{
+    struct hs_subtree *st;
+    int i;
+
+    HASH_FIND(hh, t_build->subtree_tbl, &sig, sizeof(sig), st);
+    for (; st != NULL; st = st->next) {
+        if (st->num != rg->num || memcmp(st->key, key,
+                    rg->num * KEY_WORDS * sizeof(*key)) != 0) {
+            continue;
+        }
+        for (i = 0; i < rg->num; i++) {
+            if (st->pri[i] != REGION_RULE(rg, i)->pri) {
+                break;
+            }
         }
+        if (i == rg->num) {
+            return st;
+        }
+    }
 
-        if (++pnt_num > max_pnt) {
-            max_pnt = pnt_num;
+    return NULL;
+}
+
+/* takes over @key */
+static void add_hs_subtree(const struct hs_region *rg, uint64_t sig,
+        uint32_t *key, struct hs_node *node)
+{
+    struct hs_subtree *st, *head;
+    int i;
+
+    st = malloc(sizeof(*st));
+    if (st == NULL || (st->pri = malloc(rg->num * sizeof(int))) == NULL) {
+        SAFE_FREE(st);
+        SAFE_FREE(key);
+        return; /* not fatal, the subtree just won't be shared */
+    }
+
+    st->sig = sig;
+    st->num = rg->num;
+    st->key = key;
+    for (i = 0; i < rg->num; i++) {
+        st->pri[i] = REGION_RULE(rg, i)->pri;
+    }
+    st->node = node;
+    st->next = NULL;
+
+    HASH_FIND(hh, t_build->subtree_tbl, &sig, sizeof(sig), head);
+    if (head != NULL) {
+        st->next = head->next;
+        head->next = st;
+    } else {
+        HASH_ADD(hh, t_build->subtree_tbl, sig, sizeof(st->sig), st);
+    }
+
+    return;
+}
+
+static void cleanup_hs_subtrees(void)
+{
+    struct hs_subtree *st, *tmp, *next;
+
+    HASH_ITER(hh, t_build->subtree_tbl, st, tmp) {
+        HASH_DEL(t_build->subtree_tbl, st);
+        for (; st != NULL; st = next) {
+            next = st->next;
+            SAFE_FREE(st->pri);
+            SAFE_FREE(st->key);
+            SAFE_FREE(st);
         }
+    }
 
-        if (depth == 0) {
-            g_statistics.segment_num[d] = pnt_num;
-            g_statistics.segment_total *= pnt_num;
+    return;
+}
+
+/* sharing by priorities is only exact if no two rules have the same one */
+static int pri_cmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static int has_unique_pri(const struct rule_set *rs)
+{
+    int *pri, i, ret = 1;
+
+    if ((pri = malloc(rs->num * sizeof(*pri))) == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < rs->num; i++) {
+        pri[i] = rs->r_rules[i].pri;
+    }
+    qsort(pri, rs->num, sizeof(*pri), pri_cmp);
+    for (i = 1; i < rs->num; i++) {
+        if (pri[i] == pri[i - 1]) {
+            ret = 0;
+            break;
         }
+    }
 
+    SAFE_FREE(pri);
+    return ret;
+}
 
-        if (pnt_num < 3) {
-            continue; /* skip this dim: no more ranges */
+/*
+ * arena
+ */
+
+/* zeroed memory that lives as long as @arena */
+static void *hs_arena_alloc(struct hs_arena *arena, size_t size, size_t align)
+{
+    struct hs_chunk *c = arena->chunk;
+    size_t off = 0, need;
+
+    if (c != NULL) {
+        off = ALIGN(c->used, align);
+    }
+
+    if (c == NULL || off + size > c->size) {
+        /* a big request gets a chunk of its own behind the current one */
+        need = size > HS_CHUNK_SIZE / 4 ? size : HS_CHUNK_SIZE;
+        if (posix_memalign((void **)&c, CACHE_LINE_SIZE,
+                    sizeof(*c) + need) != 0) {
+            return NULL;
         }
+        c->size = need;
+        c->used = 0;
+        if (need == size && arena->chunk != NULL) {
+            c->next = arena->chunk->next;
+            arena->chunk->next = c;
+        } else {
+            c->next = arena->chunk;
+            arena->chunk = c;
+        }
+        off = 0;
+    }
+
+    c->used = off + size;
+    memset(&c->mem[off], 0, size);
+
+    return &c->mem[off];
+}
+
+/* hand the chunks of @src over to @dst */
+static void merge_hs_arena(struct hs_arena *dst, struct hs_arena *src)
+{
+    struct hs_chunk *c;
+
+    if (src->chunk == NULL) {
+        return;
+    }
+
+    for (c = src->chunk; c->next != NULL; c = c->next) {
+        ;
+    }
+    if (dst->chunk != NULL) {
+        c->next = dst->chunk->next;
+        dst->chunk->next = src->chunk;
+    } else {
+        dst->chunk = src->chunk;
+    }
+    src->chunk = NULL;
+
+    return;
+}
+
+static void free_hs_arena(struct hs_arena *arena)
+{
+    struct hs_chunk *c, *next;
+
+    for (c = arena->chunk; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+    bzero(arena, sizeof(*arena));
+
+    return;
+}
+
+static struct hs_node *alloc_hs_node(struct hs_arena *arena)
+{
+    struct hs_node *node = arena->free_node;
+
+    if (node == NULL) {
+        return hs_arena_alloc(arena, sizeof(*node), sizeof(void *));
+    }
+    arena->free_node = node->child[0];
+    bzero(node, sizeof(*node));
+
+    return node;
+}
+
+static void free_hs_node(struct hs_arena *arena, struct hs_node *node)
+{
+    node->child[0] = arena->free_node;
+    arena->free_node = node;
+
+    return;
+}
+
+static size_t hs_arena_size(const struct hs_arena *arena)
+{
+    const struct hs_chunk *c;
+    size_t size = 0;
+
+    for (c = arena->chunk; c != NULL; c = c->next) {
+        size += sizeof(*c) + c->size;
+    }
+
+    return size;
+}
+
+/*
+ * scratch stack
+ */
+static int grow_hs_scratch(void **buf, int *cap, int num, size_t size)
+{
+    void *grown;
+
+    if (num <= *cap) {
+        return 0;
+    }
+
+    if ((grown = realloc(*buf, num * size)) == NULL) {
+        return -1;
+    }
+    *buf = grown;
+    *cap = num;
+
+    return 0;
+}
+
+/* the next level, with room for the segments of @num rules */
+static struct hs_scratch *push_hs_scratch(int num)
+{
+    struct hs_scratch **levels, *lv;
+    int cap;
+
+    if (t_scratch_top == t_scratch_num) {
+        levels = realloc(t_scratch, (t_scratch_num + 1) * sizeof(*levels));
+        if (levels == NULL) {
+            return NULL;
+        }
+        t_scratch = levels;
+        if ((t_scratch[t_scratch_num] = calloc(1, sizeof(*lv))) == NULL) {
+            return NULL;
+        }
+        t_scratch_num++;
+    }
+
+    lv = t_scratch[t_scratch_top];
+    cap = lv->pnt_cap;
+    if (grow_hs_scratch((void **)&lv->wght, &cap, num << 1,
+                sizeof(*lv->wght)) != 0) {
+        return NULL;
+    }
+    cap = lv->pnt_cap;
+    if (grow_hs_scratch((void **)&lv->seg_pnts, &cap, num << 1,
+                sizeof(*lv->seg_pnts)) != 0) {
+        return NULL;
+    }
+    lv->pnt_cap = cap;
+    t_scratch_top++;
+
+    return lv;
+}
+
+static int *hs_scratch_idx(struct hs_scratch *lv, int i, int num)
+{
+    if (grow_hs_scratch((void **)&lv->idx[i], &lv->idx_cap[i], num,
+                sizeof(*lv->idx[i])) != 0) {
+        return NULL;
+    }
+
+    return lv->idx[i];
+}
+
+static void pop_hs_scratch(void)
+{
+    t_scratch_top--;
+
+    return;
+}
+
+static void free_hs_scratch(void)
+{
+    int i;
+
+    for (i = 0; i < t_scratch_num; i++) {
+        SAFE_FREE(t_scratch[i]->wght);
+        SAFE_FREE(t_scratch[i]->seg_pnts);
+        SAFE_FREE(t_scratch[i]->idx[0]);
+        SAFE_FREE(t_scratch[i]->idx[1]);
+        SAFE_FREE(t_scratch[i]);
+    }
+    SAFE_FREE(t_scratch);
+    t_scratch_num = t_scratch_top = 0;
+
+    return;
+}
+
+/*
+ * build task pool
+ */
+static void run_hs_task(struct hs_task *task)
+{
+    task->run(task);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+
+    return;
+}
+
+static struct hs_task *pop_hs_task(struct hs_worker *w)
+{
+    struct hs_task *task = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail > w->head) {
+        task = w->deque[--w->tail];
+        if (w->tail == w->head) {
+            w->head = w->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return task;
+}
+
+static struct hs_task *steal_hs_task(struct hs_worker *self)
+{
+    struct hs_task *task = NULL;
+    struct hs_worker *w;
+    struct hs_build *b = self->build;
+    int i, v = rand_r(&self->seed) % b->worker_num;
+
+    for (i = 0; i < b->worker_num && task == NULL; i++) {
+        w = &b->workers[(v + i) % b->worker_num];
+        if (w == self || __atomic_load_n(&w->tail, __ATOMIC_RELAXED) ==
+                __atomic_load_n(&w->head, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (w->tail > w->head) {
+            task = w->deque[w->head++];
+            if (w->tail == w->head) {
+                w->head = w->tail = 0;
+            }
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return task;
+}
+
+/* outside of the pool, or with a full deque, the task runs right away */
+static void spawn_hs_task(struct hs_task *task)
+{
+    struct hs_worker *w = t_worker;
+
+    task->done = 0;
+    if (w != NULL) {
+        pthread_mutex_lock(&w->lock);
+        if (w->tail < HS_DEQUE_MAX) {
+            w->deque[w->tail++] = task;
+            pthread_mutex_unlock(&w->lock);
+            return;
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    run_hs_task(task);
+
+    return;
+}
+
+static void sync_hs_task(struct hs_task *task)
+{
+    struct hs_task *other;
+
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+        if ((other = pop_hs_task(t_worker)) != NULL ||
+                (other = steal_hs_task(t_worker)) != NULL) {
+            run_hs_task(other);
+        } else {
+            sched_yield();
+        }
+    }
+
+    return;
+}
+
+static void *hs_worker_main(void *arg)
+{
+    struct hs_worker *w = arg;
+    struct hs_task *task;
+
+    t_worker = w;
+    t_build = w->build;
+    t_stats = &w->stats;
+    t_arena = &w->arena;
+
+    while (!__atomic_load_n(&w->build->stop, __ATOMIC_ACQUIRE)) {
+        if ((task = pop_hs_task(w)) != NULL ||
+                (task = steal_hs_task(w)) != NULL) {
+            run_hs_task(task);
+        } else {
+            sched_yield();
+        }
+    }
+
+    free_hs_scratch();
+    return NULL;
+}
+
+/* the calling thread is worker 0, it keeps counting into its own stats */
+static void start_hs_pool(int num)
+{
+    struct hs_build *b = t_build;
+    int i;
+
+    if (num <= 1 || (b->workers = calloc(num, sizeof(*b->workers))) == NULL) {
+        return;
+    }
+
+    b->worker_num = num;
+    b->stop = 0;
+    for (i = 0; i < num; i++) {
+        pthread_mutex_init(&b->workers[i].lock, NULL);
+        b->workers[i].seed = i + 1;
+        b->workers[i].build = b;
+    }
+
+    t_worker = &b->workers[0];
+    for (i = 1; i < num; i++) {
+        if (pthread_create(&b->workers[i].tid, NULL, hs_worker_main,
+                    &b->workers[i]) != 0) {
+            break;
+        }
+    }
+    b->worker_num = i;
+
+    return;
+}
+
+/* the nodes the workers built go to @arena, what they counted to t_stats */
+static void stop_hs_pool(struct hs_arena *arena)
+{
+    struct hs_build *b = t_build;
+    int i;
+
+    if (b->workers == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+    for (i = 1; i < b->worker_num; i++) {
+        pthread_join(b->workers[i].tid, NULL);
+        merge_hs_arena(arena, &b->workers[i].arena);
+        merge_hs_stats(t_stats, &b->workers[i].stats);
+    }
+
+    for (i = 0; i < b->worker_num; i++) {
+        pthread_mutex_destroy(&b->workers[i].lock);
+    }
+    SAFE_FREE(b->workers);
+    b->worker_num = 0;
+    t_worker = NULL;
+
+    return;
+}
+
+/*
+ * leaf buckets
+ */
+/* the free list of the buckets with at least @lanes lanes */
+static int hs_free_class(int lanes)
+{
+    int c = lanes > 1 ? 32 - __builtin_clz(lanes - 1) : 0;
+
+    return c < HS_FREE_BUCKETS ? c : HS_FREE_BUCKETS - 1;
+}
+
+/* a bucket from the free lists, its slots padded again */
+static struct hs_bucket *reuse_hs_bucket(struct hs_arena *arena, int cap)
+{
+    struct hs_bucket **pb, *b;
+    int d, i;
+
+    pb = &arena->free_bucket[hs_free_class(cap / HS_BUCKET_LANES)];
+    if ((b = *pb) == NULL || b->cap < cap) {
+        return NULL;
+    }
+    *pb = b->next;
+
+    b->num = 0;
+    b->next = NULL;
+    for (d = 0; d < DIM_MAX; d++) {
+        for (i = 0; i < b->cap; i++) {
+            b->lo[d][i] = UINT32_MAX;
+            b->hi[d][i] = 0;
+        }
+    }
+    for (i = 0; i < b->cap; i++) {
+        b->pri[i] = -1;
+    }
+
+    return b;
+}
+
+static void free_hs_bucket(struct hs_arena *arena, struct hs_bucket *b)
+{
+    /* the list of the largest power of two not over its lanes */
+    int c = 31 - __builtin_clz(b->cap / HS_BUCKET_LANES);
+    struct hs_bucket **pb;
+
+    pb = &arena->free_bucket[c < HS_FREE_BUCKETS ? c : HS_FREE_BUCKETS - 1];
+    b->next = *pb;
+    *pb = b;
+
+    return;
+}
+
+static struct hs_bucket *alloc_hs_bucket(struct hs_arena *arena, int cap)
+{
+    struct hs_bucket *b;
+    uint32_t *mem;
+    int d, i;
+
+    cap = ALIGN(cap, HS_BUCKET_LANES);
+    if ((b = reuse_hs_bucket(arena, cap)) != NULL) {
+        return b;
+    }
+
+    b = hs_arena_alloc(arena, sizeof(*b), sizeof(void *));
+    mem = hs_arena_alloc(arena, (DIM_MAX * 2 + 1) * cap * sizeof(*mem),
+            CACHE_LINE_SIZE);
+    if (b == NULL || mem == NULL) {
+        return NULL;
+    }
+
+    b->num = 0;
+    b->cap = cap;
+    for (d = 0; d < DIM_MAX; d++) {
+        b->lo[d] = &mem[d * 2 * cap];
+        b->hi[d] = &mem[(d * 2 + 1) * cap];
+        for (i = 0; i < cap; i++) {
+            b->lo[d][i] = UINT32_MAX;
+            b->hi[d][i] = 0;
+        }
+    }
+    b->pri = (int *)&mem[DIM_MAX * 2 * cap];
+    for (i = 0; i < cap; i++) {
+        b->pri[i] = -1;
+    }
+
+    return b;
+}
+
+static size_t hs_bucket_size(const struct hs_bucket *b)
+{
+    return sizeof(*b) + (DIM_MAX * 2 + 1) * b->cap * sizeof(uint32_t);
+}
+
+static struct hs_bucket *dup_hs_bucket(struct hs_arena *arena,
+        const struct hs_bucket *b)
+{
+    struct hs_bucket *copy = alloc_hs_bucket(arena, b->cap);
+    int d;
+
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    /* a reused bucket may have more lanes, the arrays are copied apart */
+    copy->num = b->num;
+    for (d = 0; d < DIM_MAX; d++) {
+        memcpy(copy->lo[d], b->lo[d], b->cap * sizeof(uint32_t));
+        memcpy(copy->hi[d], b->hi[d], b->cap * sizeof(uint32_t));
+    }
+    memcpy(copy->pri, b->pri, b->cap * sizeof(int));
+
+    return copy;
+}
+
+/*
+ * put @r in priority order, a full bucket is replaced by one twice its
+ * size. The old one stays in the arena until the tree goes.
+ */
+static int insrt_hs_bucket(struct hs_arena *arena, struct hs_bucket **pb,
+        const struct rng_rule *r)
+{
+    struct hs_bucket *b = *pb, *grown;
+    int d, i, j;
+
+    if (b->num == b->cap) {
+        if ((grown = alloc_hs_bucket(arena, b->cap << 1)) == NULL) {
+            return -1;
+        }
+        for (i = 0; i < b->num; i++) {
+            for (d = 0; d < DIM_MAX; d++) {
+                grown->lo[d][i] = b->lo[d][i];
+                grown->hi[d][i] = b->hi[d][i];
+            }
+            grown->pri[i] = b->pri[i];
+        }
+        grown->num = b->num;
+        *pb = b = grown;
+    }
+
+    for (i = b->num; i > 0 && b->pri[i - 1] > r->pri; i--) {
+        ;
+    }
+    for (j = b->num; j > i; j--) {
+        for (d = 0; d < DIM_MAX; d++) {
+            b->lo[d][j] = b->lo[d][j - 1];
+            b->hi[d][j] = b->hi[d][j - 1];
+        }
+        b->pri[j] = b->pri[j - 1];
+    }
+    for (d = 0; d < DIM_MAX; d++) {
+        b->lo[d][i] = r->dim[d][0].u32;
+        b->hi[d][i] = r->dim[d][1].u32;
+    }
+    b->pri[i] = r->pri;
+    b->num++;
+
+    return 0;
+}
+
+static size_t hs_tree_memory(const struct hs_stats *st)
+{
+    return (st->tree_node_num + st->leaf_node_num) *
+        sizeof(struct hs_node) + st->bucket_memory;
+}
+
+static void count_hs_leaf(int depth)
+{
+    t_stats->leaf_node_num++;
+    count_hs_depth(t_stats, depth, 1, 1);
+    t_stats->average_depth += depth;
+    if (t_stats->worst_depth < depth) {
+        t_stats->worst_depth = depth;
+    }
+    __atomic_add_fetch(&t_build->memory, sizeof(struct hs_node),
+            __ATOMIC_RELAXED);
+
+    return;
+}
+
+/*
+ * end the tree in a leaf holding all rules of @rg. Rules behind the first
+ * one covering the whole set can never match and are left out.
+ */
+static int build_hs_bucket(const struct hs_region *rg,
+        struct hs_node *cur_node, int depth)
+{
+    union point box[DIM_MAX][2], lo, hi;
+    struct rng_rule r;
+    int tested[DIM_MAX];
+    int num, d, i;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        box[d][0] = region_pnt(rg, 0, d, 0);
+        box[d][1] = region_pnt(rg, 0, d, 1);
+        for (i = 1, tested[d] = 0; i < rg->num; i++) {
+            lo = region_pnt(rg, i, d, 0);
+            hi = region_pnt(rg, i, d, 1);
+            if (!is_equal(&lo, &box[d][0]) || !is_equal(&hi, &box[d][1])) {
+                tested[d] = 1;
+            }
+            if (is_less(&lo, &box[d][0])) {
+                box[d][0] = lo;
+            }
+            if (is_greater(&hi, &box[d][1])) {
+                box[d][1] = hi;
+            }
+        }
+    }
+
+    for (num = 0; num < rg->num; ) {
+        for (d = 0; d < DIM_MAX; d++) {
+            lo = region_pnt(rg, num, d, 0);
+            hi = region_pnt(rg, num, d, 1);
+            if (is_greater(&lo, &box[d][0]) || is_less(&hi, &box[d][1])) {
+                break;
+            }
+        }
+        num++;
+        if (d == DIM_MAX) {
+            break;
+        }
+    }
+
+    cur_node->d2s = -1;
+    cur_node->depth = depth;
+    cur_node->height = 0;
+    cur_node->size = 1;
+    cur_node->base_height = 0;
+    cur_node->base_size = 1;
+    cur_node->thresh.u64 = REGION_RULE(rg, 0)->pri;
+    cur_node->child[0] = NULL;
+    cur_node->child[1] = NULL;
+    cur_node->bucket = NULL;
+
+    if (num > 1) {
+        if ((cur_node->bucket = alloc_hs_bucket(t_arena, num)) == NULL) {
+            return -1;
+        }
+        /*
+         * a dimension all the rules agree on is left out of the key the
+         * subtree is shared by, see sign_rule_set(). The bucket may end
+         * up in regions the rules span differently there, so it does not
+         * test it, like a leaf node does not.
+         */
+        for (i = 0; i < num; i++) {
+            r = *REGION_RULE(rg, i);
+            for (d = 0; d < DIM_MAX; d++) {
+                if (tested[d]) {
+                    r.dim[d][0] = region_pnt(rg, i, d, 0);
+                    r.dim[d][1] = region_pnt(rg, i, d, 1);
+                } else {
+                    r.dim[d][0].u128.low = r.dim[d][0].u128.high = 0;
+                    r.dim[d][1].u128.low = r.dim[d][1].u128.high = UINT64_MAX;
+                }
+            }
+            insrt_hs_bucket(t_arena, &cur_node->bucket, &r);
+        }
+
+        t_stats->bucket_num++;
+        t_stats->bucket_rules += num;
+        t_stats->bucket_memory += hs_bucket_size(cur_node->bucket);
+        if (num > hs_conf.binth) {
+            t_stats->bucket_forced++;
+        }
+        __atomic_add_fetch(&t_build->memory, hs_bucket_size(cur_node->bucket),
+                __ATOMIC_RELAXED);
+    }
+
+    count_hs_leaf(depth);
+    return 0;
+}
+
+static struct hs_node *build_hs_child(const struct hs_region *rg, int depth);
+
+/* height and size of inner node @node from its children */
+static void set_hs_height(struct hs_node *node)
+{
+    struct hs_node *l = node->child[0], *r = node->child[1];
+
+    node->height = (l->height > r->height ? l->height : r->height) + 1;
+    node->size = l->size + r->size + 1;
+
+    return;
+}
+
+/* the cut a dimension offers, valid if pnt_num >= 3 */
+struct hs_dim_split {
+    int pnt_num;
+    float wght_avg;     /* rules per segment, the less the better */
+    union point thresh;
+    struct range lrange, rrange;
+};
+
+/* @seg_pnts and @wght hold rg->num * 2 entries */
+static void split_hs_dim(const struct hs_region *rg, int d,
+        struct seg_point *seg_pnts, int *wght, struct hs_dim_split *split)
+{
+    const int *ends = rg->ends[d];
+    union point pnt, next;
+    int num, pnt_num, wght_all, begin, end, i;
+    float wght_jdg;
+
+    num = rg->num << 1;
+
+    /*
+     * make segments from the sorted bounds: one point per value, or two
+     * when rules both begin and end at it. A rule covers the segments
+     * from the first point of its low bound to the last of its high one,
+     * so it marks wght at both and a prefix sum gives the rules per
+     * segment, as gen_seg_wght() does with searches.
+     */
+    pnt = region_pnt(rg, ends[0] >> 1, d, ends[0] & 1);
+    for (pnt_num = 0, begin = end = 0, i = 0; i < num; i++) {
+        if (ends[i] & 1) {
+            end++;
+        } else {
+            begin++;
+        }
+
+        if (i + 1 < num) {
+            next = region_pnt(rg, ends[i + 1] >> 1, d, ends[i + 1] & 1);
+            if (next.u128.high == pnt.u128.high &&
+                    next.u128.low == pnt.u128.low) {
+                continue;
+            }
+        }
+
+        seg_pnts[pnt_num].pnt = pnt;
+        seg_pnts[pnt_num].flag.begin = begin > 0;
+        wght[pnt_num] = begin;
+        if (begin > 0 && end > 0) {
+            seg_pnts[pnt_num++].flag.end = 0;
+            seg_pnts[pnt_num].pnt = pnt;
+            seg_pnts[pnt_num].flag.begin = 0;
+            wght[pnt_num] = 0;
+        }
+        seg_pnts[pnt_num].flag.end = end > 0;
+        wght[pnt_num++] -= end;
+
+        pnt = next;
+        begin = end = 0;
+    }
+
+    split->pnt_num = pnt_num;
+    if (pnt_num < 3) {
+        return; /* no more ranges */
+    }
+
+    /*
+     * gen heuristic info
+     */
+    wght_all = sum_seg_wght(wght, pnt_num);
+    split->wght_avg = (float)wght_all / (pnt_num - 1);
+
+    for (wght_jdg = wght[0], i = 1; i < pnt_num - 1;
+        wght_jdg += wght[i], i++) {
+
+        split->thresh = seg_pnts[i].pnt;
+        if (seg_pnts[i].flag.begin) {
+            point_dec(&split->thresh);
+        }
+
+        if (wght_jdg > (wght_all / 2.f)) {
+            break; /* reach the half of the wght */
+        }
+    }
+
+    split->lrange.begin = seg_pnts[0].pnt;
+    split->lrange.end = split->thresh;
+
+    split->rrange.begin = split->thresh;
+    point_inc(&split->rrange.begin);
+    split->rrange.end = seg_pnts[pnt_num - 1].pnt;
+
+    return;
+}
+
+struct hs_dim_task {
+    struct hs_task task;
+    const struct hs_region *rg;
+    int d;
+    int ret;
+    struct hs_dim_split split;
+};
+
+static void run_hs_dim_task(struct hs_task *task)
+{
+    struct hs_dim_task *dt = (typeof(dt))task;
+    struct hs_scratch *lv = push_hs_scratch(dt->rg->num);
+
+    if (lv == NULL) {
+        dt->ret = -1;
+        return;
+    }
+
+    split_hs_dim(dt->rg, dt->d, lv->seg_pnts, lv->wght, &dt->split);
+    dt->ret = 0;
+    pop_hs_scratch();
+
+    return;
+}
+
+struct hs_child_task {
+    struct hs_task task;
+    struct hs_region rg;
+    int depth;
+    struct hs_node *node;
+};
+
+static void run_hs_child_task(struct hs_task *task)
+{
+    struct hs_child_task *ct = (typeof(ct))task;
+
+    ct->node = build_hs_child(&ct->rg, ct->depth);
+
+    return;
+}
+
+/*
+ * the part of @rg within @range on @d2s. @idx takes rg->num indices, then
+ * rg->num * 2 bounds per dim; @pos, rg->num entries, is scratch.
+ */
+static void gen_hs_child_region(const struct hs_region *rg, int d2s,
+        struct range *range, int *idx, int *pos, struct hs_region *child)
+{
+    union point lo, hi;
+    int *ends, d, i, j;
+
+    child->rs = rg->rs;
+    memcpy(child->box, rg->box, sizeof(child->box));
+    child->box[d2s][0] = range->begin;
+    child->box[d2s][1] = range->end;
+
+    for (i = 0, child->num = 0; i < rg->num; i++) {
+        lo = region_pnt(rg, i, d2s, 0);
+        hi = region_pnt(rg, i, d2s, 1);
+        if (is_greater(&lo, &range->end) || is_less(&hi, &range->begin)) {
+            pos[i] = -1;
+            continue;
+        }
+
+        pos[i] = child->num;
+        idx[child->num++] = rg->idx != NULL ? rg->idx[i] : i;
+    }
+    child->idx = idx;
+
+    /* a stable filter keeps the bounds sorted, even cut to the new box */
+    for (d = 0, ends = idx + rg->num; d < DIM_MAX;
+            d++, ends += rg->num << 1) {
+        for (i = 0, j = 0; i < rg->num << 1; i++) {
+            if (pos[rg->ends[d][i] >> 1] >= 0) {
+                ends[j++] = pos[rg->ends[d][i] >> 1] << 1 |
+                    (rg->ends[d][i] & 1);
+            }
+        }
+        child->ends[d] = ends;
+    }
+
+    return;
+}
+
+static int build_hs_tree(
+        const struct hs_region *rg, struct hs_node *cur_node, int depth)
+{
+    float wght_avg;
+    int max_pnt, d2s, d, ret;
+
+    struct hs_region child;
+    struct hs_scratch *lv;
+    int *idx;
+    struct hs_dim_split split[DIM_MAX];
+    struct hs_dim_task dim_task[DIM_MAX];
+    struct hs_child_task left;
+
+    /* small regions, and any region once the budget is spent, are scanned */
+    if (rg->num > 1 && (rg->num <= hs_conf.binth ||
+            (hs_conf.max_depth > 0 && depth >= hs_conf.max_depth) ||
+            (hs_conf.max_mem > 0 && __atomic_load_n(&t_build->memory,
+                __ATOMIC_RELAXED) >= hs_conf.max_mem))) {
+        return build_hs_bucket(rg, cur_node, depth);
+    }
+
+    cur_node->bucket = NULL;
+    max_pnt = d2s = 0;
+    wght_avg = rg->num + 1; //max, all rules project one segment
+
+    if ((lv = push_hs_scratch(rg->num)) == NULL) {
+        return -1;
+    }
+
+    /*
+     * start here, big sets scan the other dims on the pool meanwhile
+     */
+    ret = 0;
+    if (t_worker != NULL && rg->num >= HS_DIM_TASK_RULES) {
+        for (d = 1; d < DIM_MAX; d++) {
+            dim_task[d].task.run = run_hs_dim_task;
+            dim_task[d].rg = rg;
+            dim_task[d].d = d;
+            spawn_hs_task(&dim_task[d].task);
+        }
+        split_hs_dim(rg, 0, lv->seg_pnts, lv->wght, &split[0]);
+        for (d = 1; d < DIM_MAX; d++) {
+            sync_hs_task(&dim_task[d].task);
+            split[d] = dim_task[d].split;
+            ret |= dim_task[d].ret;
+        }
+    } else {
+        for (d = 0; d < DIM_MAX; d++) {
+            split_hs_dim(rg, d, lv->seg_pnts, lv->wght, &split[d]);
+        }
+    }
+
+    if (ret != 0) {
+        pop_hs_scratch();
+        return -1;
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (split[d].pnt_num > max_pnt) {
+            max_pnt = split[d].pnt_num;
+        }
+
+        if (depth == 0) {
+            t_stats->segment_num[d] = split[d].pnt_num;
+            t_stats->segment_total *= split[d].pnt_num;
+        }
+
+        if (split[d].pnt_num < 3) {
+            continue; /* skip this dim: no more ranges */
+        }
+
+        if (wght_avg <= split[d].wght_avg) {
+            continue; /* skip this dim: the less the better */
+        }
+
+        /*
+         * found dimension candidate
+         */
+        d2s = d, wght_avg = split[d].wght_avg;
+    }
+
+    /*
+     * gen leaf node
+     */
+    if (max_pnt < 3) {
+        cur_node->d2s = -1;
+        cur_node->depth = depth;
+        cur_node->height = 0;
+        cur_node->size = 1;
+        cur_node->base_height = 0;
+        cur_node->base_size = 1;
+        cur_node->thresh.u64 = REGION_RULE(rg, 0)->pri;
+        cur_node->child[0] = NULL;
+        cur_node->child[1] = NULL;
+
+        pop_hs_scratch();
+        count_hs_leaf(depth);
+        return 0;
+    }
+
+    cur_node->d2s = d2s;
+    t_stats->choose[d2s]++;
+    t_stats->choose_num++;
+    t_stats->choose_depth += depth;
+    cur_node->depth = depth;
+    cur_node->thresh = split[d2s].thresh;
+    cur_node->child[0] = NULL;
+    cur_node->child[1] = NULL;
+
+
+    /*
+     * gen left child, on the pool if it is big enough
+     */
+    left.task.run = NULL;
+    if ((idx = hs_scratch_idx(lv, 0, rg->num * HS_REGION_INTS)) == NULL) {
+        pop_hs_scratch();
+        return -1;
+    }
+    /* the weights are done with, they map rules to the child's */
+    gen_hs_child_region(rg, d2s, &split[d2s].lrange, idx, lv->wght, &child);
+
+    if (t_worker != NULL && child.num >= HS_TASK_RULES && (idx =
+                hs_scratch_idx(lv, 1, rg->num * HS_REGION_INTS)) != NULL) {
+        /* the task keeps these indices, the right child takes the others */
+        left.rg = child;
+        left.task.run = run_hs_child_task;
+        left.depth = depth + 1;
+        spawn_hs_task(&left.task);
+    } else {
+        cur_node->child[0] = build_hs_child(&child, depth + 1);
+    }
+
+    /*
+     * gen right child
+     */
+    if (left.task.run != NULL || cur_node->child[0] != NULL) {
+        gen_hs_child_region(rg, d2s, &split[d2s].rrange, idx, lv->wght,
+                &child);
+        cur_node->child[1] = build_hs_child(&child, depth + 1);
+    }
+
+    if (left.task.run != NULL) {
+        sync_hs_task(&left.task);
+        cur_node->child[0] = left.node;
+    }
+
+    pop_hs_scratch();
+    if (cur_node->child[0] == NULL || cur_node->child[1] == NULL) {
+        return -1;
+    }
+    set_hs_height(cur_node);
+    cur_node->base_height = cur_node->height;
+    cur_node->base_size = cur_node->size;
+
+    t_stats->tree_node_num++;
+    count_hs_depth(t_stats, depth, 0, 1);
+    __atomic_add_fetch(&t_build->memory, sizeof(struct hs_node),
+            __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* reuse the subtree of an identical trimmed rule set if there is one */
+static struct hs_node *build_hs_child(const struct hs_region *rg, int depth)
+{
+    struct hs_subtree *st;
+    struct hs_node *node;
+    uint32_t *key = NULL;
+    uint64_t sig = 0;
+
+    /* a single rule always ends in a leaf, not worth a table entry */
+    if (t_build->subtree_dedup && rg->num > 1 &&
+            (key = sign_rule_set(rg, &sig)) != NULL) {
+        pthread_mutex_lock(&t_build->subtree_lock);
+        if ((st = find_hs_subtree(rg, sig, key)) != NULL) {
+            __atomic_add_fetch(&st->node->ref, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&t_build->subtree_lock);
+            SAFE_FREE(key);
+            t_stats->shared_num++;
+            return st->node;
+        }
+        pthread_mutex_unlock(&t_build->subtree_lock);
+    }
+
+    node = alloc_hs_node(t_arena);
+    if (node == NULL) {
+        SAFE_FREE(key);
+        return NULL;
+    }
+    node->ref = 1;
+
+    if (build_hs_tree(rg, node, depth) != 0) {
+        SAFE_FREE(key);
+        return NULL;
+    }
+
+    /* sets built by two workers at once are simply not shared */
+    if (key != NULL) {
+        pthread_mutex_lock(&t_build->subtree_lock);
+        add_hs_subtree(rg, sig, key, node);
+        pthread_mutex_unlock(&t_build->subtree_lock);
+    }
+
+    return node;
+}
+
+/* copy on write: give @node a private copy of a shared child */
+static struct hs_node *own_hs_child(struct hs_tree *tree,
+        struct hs_node *node, int i)
+{
+    struct hs_node *child = node->child[i], *copy;
+
+    if (child->ref == 1) {
+        return child;
+    }
+
+    copy = alloc_hs_node(&tree->arena);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    *copy = *child;
+    copy->ref = 1;
+    if (child->bucket != NULL &&
+            (copy->bucket = dup_hs_bucket(&tree->arena, child->bucket)) == NULL) {
+        return NULL;
+    }
+    tree->stats.update_nodes++;
+    if (copy->child[0] != NULL && copy->child[1] != NULL) {
+        copy->child[0]->ref++;
+        copy->child[1]->ref++;
+        tree->stats.tree_node_num++;
+        count_hs_depth(&tree->stats, copy->depth, 0, 1);
+    } else {
+        tree->stats.leaf_node_num++;
+        tree->stats.average_depth += copy->depth;
+        count_hs_depth(&tree->stats, copy->depth, 1, 1);
+        if (copy->bucket != NULL) {
+            tree->stats.bucket_num++;
+            tree->stats.bucket_rules += copy->bucket->num;
+            tree->stats.bucket_memory += hs_bucket_size(copy->bucket);
+        }
+    }
+
+    child->ref--;
+    node->child[i] = copy;
+
+    return copy;
+}
+
+/*
+ * number of slots a breadth first layout needs: a subtree reached from
+ * several parents takes one slot per parent but is laid out only once
+ */
+static size_t count_hs_nodes(struct hs_node *node, struct hs_node_map **map)
+{
+    struct hs_node_map *m;
+
+    if (node->child[0] == NULL && node->child[1] == NULL) {
+        return 1;
+    }
+
+    /* without a map entry the subtree is laid out once per parent */
+    if (node->ref > 1) {
+        HASH_FIND_PTR(*map, &node, m);
+        if (m != NULL) {
+            return 1;
+        }
+        if ((m = malloc(sizeof(*m))) != NULL) {
+            m->node = node;
+            m->idx = UINT32_MAX;
+            HASH_ADD_PTR(*map, node, m);
+        }
+    }
+
+    return 1 + count_hs_nodes(node->child[0], map) +
+        count_hs_nodes(node->child[1], map);
+}
+
+static void cleanup_hs_node_map(struct hs_node_map **map)
+{
+    struct hs_node_map *m, *tmp;
+
+    HASH_ITER(hh, *map, m, tmp) {
+        HASH_DEL(*map, m);
+        SAFE_FREE(m);
+    }
+
+    return;
+}
+
+/* compiled leaves refer to their bucket by its index in @tree */
+static int add_hs_bucket_ref(struct hs_tree *tree, struct hs_bucket *b)
+{
+    struct hs_bucket **buckets;
+    size_t cap;
+
+    if (tree->bucket_num == tree->bucket_cap) {
+        cap = tree->bucket_cap ? tree->bucket_cap << 1 : 64;
+        buckets = realloc(tree->buckets, cap * sizeof(*buckets));
+        if (buckets == NULL) {
+            return -1;
+        }
+        tree->buckets = buckets;
+        tree->bucket_cap = cap;
+    }
+
+    tree->buckets[tree->bucket_num++] = b;
+
+    return 0;
+}
+
+/*
+ * lay the pointer tree out breadth first, so that the children of
+ * each node are adjacent and the top levels share few cache lines
+ */
+static int compile_hs_tree(struct hs_tree *tree)
+{
+    struct hs_node **queue, *node;
+    struct hs_node_map *map = NULL, *m;
+    struct hs_flat_node *flat;
+    size_t head, tail, num;
+
+    num = count_hs_nodes(tree->root, &map);
+    if (num >= (1U << 29)) {
+        cleanup_hs_node_map(&map);
+        return -1; /* child index overflow */
+    }
+
+    queue = malloc(num * sizeof(*queue));
+    if (queue == NULL) {
+        cleanup_hs_node_map(&map);
+        return -1;
+    }
+
+    if (posix_memalign((void **)&flat, CACHE_LINE_SIZE,
+            ALIGN(num * sizeof(*flat), CACHE_LINE_SIZE)) != 0) {
+        SAFE_FREE(queue);
+        cleanup_hs_node_map(&map);
+        return -1;
+    }
+
+    tree->bucket_num = 0;
+    queue[0] = tree->root;
+    for (head = 0, tail = 1; head < tail; head++) {
+        node = queue[head];
+
+        if (node->child[0] == NULL && node->child[1] == NULL) {
+            flat[head].thresh = node->thresh.u32;
+            flat[head].dim = HS_LEAF_DIM;
+            flat[head].child = 0;
+            if (node->bucket != NULL) {
+                if (add_hs_bucket_ref(tree, node->bucket) != 0) {
+                    SAFE_FREE(queue);
+                    free(flat);
+                    cleanup_hs_node_map(&map);
+                    return -1;
+                }
+                flat[head].thresh = tree->bucket_num - 1;
+                flat[head].dim = HS_BUCKET_DIM;
+            }
+            continue;
+        }
+
+        flat[head].thresh = node->thresh.u32;
+        flat[head].dim = node->d2s;
+
+        m = NULL;
+        if (node->ref > 1) {
+            HASH_FIND_PTR(map, &node, m);
+            if (m != NULL && m->idx != UINT32_MAX) {
+                flat[head].child = m->idx;
+                continue;
+            }
+        }
+
+        flat[head].child = tail;
+        if (m != NULL) {
+            m->idx = tail;
+        }
+
+        queue[tail++] = node->child[0];
+        queue[tail++] = node->child[1];
+    }
+
+    SAFE_FREE(queue);
+    cleanup_hs_node_map(&map);
+    SAFE_FREE(tree->flat);
+    tree->flat = flat;
+    tree->flat_num = num;
+
+    return 0;
+}
+
+/*
+ * collect the in-order thresholds of the binary nodes below @node that
+ * split on @dim, at most @levels deep, and the nodes hanging under them.
+ * Shared subtrees always start a wide node of their own.
+ */
+static void collect_wide_node(struct hs_node *node, int dim, int levels,
+        uint32_t *thresh, int *thresh_num,
+        struct hs_node **frontier, int *frontier_num)
+{
+    struct hs_node *child;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        child = node->child[i];
+
+        if (levels > 1 && child->d2s == dim && child->ref == 1 &&
+                (child->child[0] != NULL || child->child[1] != NULL)) {
+            collect_wide_node(child, dim, levels - 1,
+                    thresh, thresh_num, frontier, frontier_num);
+        } else {
+            frontier[(*frontier_num)++] = child;
+        }
+
+        if (i == 0) {
+            thresh[(*thresh_num)++] = node->thresh.u32;
+        }
+    }
+
+    return;
+}
+
+static int compile_wide_hs_tree(struct hs_tree *tree, int levels)
+{
+    struct hs_node **queue, *node;
+    struct hs_node_map *map = NULL, *m;
+    struct hs_node *frontier[HS_WIDE_FANOUT];
+    uint32_t *wide, *cur;
+    size_t *depth, *depth_node[2];
+    size_t head, tail, num, leaf_num, depth_sum, worst_depth;
+    int fanout, stride, thresh_num, frontier_num, i;
+
+    fanout = 1 << levels;
+    stride = fanout << 1;
+
+    /* there are never more wide nodes than binary ones */
+    num = count_hs_nodes(tree->root, &map);
+
+    queue = malloc(num * sizeof(*queue));
+    depth = malloc(num * sizeof(*depth));
+    depth_node[0] = calloc(num + 1, sizeof(*depth_node[0]));
+    depth_node[1] = calloc(num + 1, sizeof(*depth_node[1]));
+    if (queue == NULL || depth == NULL ||
+            depth_node[0] == NULL || depth_node[1] == NULL ||
+            posix_memalign((void **)&wide, CACHE_LINE_SIZE,
+                ALIGN(num * stride * sizeof(*wide), CACHE_LINE_SIZE)) != 0) {
+        SAFE_FREE(queue);
+        SAFE_FREE(depth);
+        SAFE_FREE(depth_node[0]);
+        SAFE_FREE(depth_node[1]);
+        cleanup_hs_node_map(&map);
+        return -1;
+    }
+
+    leaf_num = depth_sum = worst_depth = 0;
+
+    tree->bucket_num = 0;
+    queue[0] = tree->root;
+    depth[0] = 0;
+    for (head = 0, tail = 1; head < tail; head++) {
+        node = queue[head];
+        cur = &wide[head * stride];
+
+        thresh_num = frontier_num = 0;
+        if (node->child[0] == NULL && node->child[1] == NULL) {
+            /* a single leaf tree still needs a node to start from */
+            cur[fanout - 1] = 0;
+            frontier[frontier_num++] = node;
+        } else {
+            cur[fanout - 1] = node->d2s;
+            collect_wide_node(node, node->d2s, levels,
+                    cur, &thresh_num, frontier, &frontier_num);
+        }
+
+        for (i = thresh_num; i < fanout - 1; i++) {
+            cur[i] = UINT32_MAX;
+        }
+
+        depth_node[0][depth[head]]++;
+        for (i = 0; i < fanout; i++) {
+            if (i >= frontier_num) {
+                cur[fanout + i] = HS_WIDE_LEAF;
+                continue;
+            }
+
+            node = frontier[i];
+            if (node->child[0] == NULL && node->child[1] == NULL) {
+                cur[fanout + i] = HS_WIDE_LEAF | node->thresh.u32;
+                if (node->bucket != NULL) {
+                    if (add_hs_bucket_ref(tree, node->bucket) != 0) {
+                        SAFE_FREE(queue);
+                        SAFE_FREE(depth);
+                        SAFE_FREE(depth_node[0]);
+                        SAFE_FREE(depth_node[1]);
+                        free(wide);
+                        cleanup_hs_node_map(&map);
+                        return -1;
+                    }
+                    cur[fanout + i] = HS_WIDE_LEAF | HS_WIDE_BUCKET |
+                        (tree->bucket_num - 1);
+                }
+                depth_node[1][depth[head] + 1]++;
+                depth_sum += depth[head] + 1;
+                leaf_num++;
+                if (worst_depth < depth[head] + 1) {
+                    worst_depth = depth[head] + 1;
+                }
+                continue;
+            }
+
+            m = NULL;
+            if (node->ref > 1) {
+                HASH_FIND_PTR(map, &node, m);
+                if (m != NULL && m->idx != UINT32_MAX) {
+                    cur[fanout + i] = m->idx;
+                    continue;
+                }
+            }
+
+            cur[fanout + i] = tail;
+            if (m != NULL) {
+                m->idx = tail;
+            }
+            depth[tail] = depth[head] + 1;
+            queue[tail++] = node;
+        }
+    }
+
+    SAFE_FREE(tree->wide);
+    tree->wide = wide;
+    tree->wide_num = tail;
+    tree->wide_fanout = fanout;
+
+    /* the depth of a leaf is the number of wide nodes above it */
+    printf("\nwide_fanout = %d", fanout);
+    printf("\nwide_worst_depth = %lu", worst_depth);
+    printf("\nwide_average_depth = %f", (float)depth_sum / leaf_num);
+    printf("\nwide_node_num = %lu", tail);
+    printf("\nwide_leaf_num = %lu", leaf_num);
+    printf("\nwide_memory = %lu", tail * stride * sizeof(*wide) +
+            tree->bucket_num * sizeof(*tree->buckets) +
+            tree->stats.bucket_memory);
+    printf("\ndepth   node    intrnl  leaf\n");
+    for (i = 0; i <= worst_depth; i++) {
+        printf("%-8d%-8lu%-8lu%-8lu\n", i, depth_node[0][i] +
+            depth_node[1][i], depth_node[0][i], depth_node[1][i]);
+    }
+    printf("\n");
+
+    SAFE_FREE(queue);
+    SAFE_FREE(depth);
+    SAFE_FREE(depth_node[0]);
+    SAFE_FREE(depth_node[1]);
+    cleanup_hs_node_map(&map);
+
+    return 0;
+}
+
+static void printf_stats_flat(const struct hs_tree *tree, int rule_num)
+{
+    /* leaf buckets are part of either layout */
+    size_t ptr_memory = hs_tree_memory(&tree->stats);
+    size_t flat_memory = tree->flat_num * sizeof(*tree->flat) +
+        tree->bucket_num * sizeof(*tree->buckets) +
+        tree->stats.bucket_memory;
+
+    printf("\nptr_memory = %lu", ptr_memory);
+    printf("\nptr_bytes_per_rule = %f", (float)ptr_memory / rule_num);
+    printf("\nflat_memory = %lu", flat_memory);
+    printf("\nflat_bytes_per_rule = %f", (float)flat_memory / rule_num);
+    printf("\n");
+
+    return;
+}
+
+static void printf_stats_nodes(const struct hs_stats *st)
+{
+    size_t i;
+
+    /* depth statistics */
+    printf("\nworst_depth = %lu", st->worst_depth);
+    printf("\naverage_depth = %f", (float)st->average_depth /
+            st->leaf_node_num);
+
+    /* node statistics */
+    printf("\ntree_node_num = %lu", st->tree_node_num);
+    printf("\nleaf_node_num = %lu", st->leaf_node_num);
+    printf("\ntotal_memory = %lu", (st->tree_node_num +
+        st->leaf_node_num) << 3);
+
+    /* bucket statistics */
+    printf("\nbucket_num = %lu", st->bucket_num);
+    printf("\nbucket_forced = %lu", st->bucket_forced);
+    printf("\nbucket_average_rules = %f", st->bucket_num ?
+            (float)st->bucket_rules / st->bucket_num : 0.f);
+    printf("\nbucket_memory = %lu", st->bucket_memory);
+
+    /* node statistics detail */
+    printf("\ndepth   node    intrnl  leaf\n");
+    for (i = 0; i <= st->worst_depth; i++) {
+        printf("%-8lu%-8lu%-8lu%-8lu\n", i, hs_depth_num(st, i, 0) +
+            hs_depth_num(st, i, 1), hs_depth_num(st, i, 0),
+            hs_depth_num(st, i, 1));
+    }
+    printf("\n");
+
+    return;
+}
+
+static int add_hs_rules(struct hs_tree *tree, const struct rng_rule *rules,
+        int num);
+
+int hs_build(const struct rule_set *rs, void *userdata)
+{
+    int i;
+    struct hs_tree *tree = calloc(1, sizeof(*tree));
+    struct hs_build build;
+    struct hs_region rg;
+    struct hs_node *root;
+    int *ends;
+
+    if (tree == NULL || rs->r_rules == NULL || (root = hs_arena_alloc(
+                    &tree->arena, sizeof(*root), sizeof(void *))) == NULL) {
+        if (tree != NULL) {
+            free_hs_arena(&tree->arena);
+        }
+        SAFE_FREE(tree);
+        return -1;
+    }
+
+    tree->root = root;
+    root->ref = 1;
+    tree->stats.segment_total = 1;
+    if (add_hs_rules(tree, rs->r_rules, rs->num) != 0) {
+        hs_cleanup(&tree);
+        return -1;
+    }
+
+    bzero(&build, sizeof(build));
+    pthread_mutex_init(&build.subtree_lock, NULL);
+    build.subtree_dedup = hs_conf.dag && has_unique_pri(rs);
+    if (hs_conf.dag && !build.subtree_dedup) {
+        printf("subtree sharing disabled: rules with the same priority\n");
+    }
+
+    t_build = &build;
+    t_stats = &tree->stats;
+    t_arena = &tree->arena;
+    start_hs_pool(hs_conf.threads);
+    init_hs_region(&rg, rs);
+    ends = malloc(rs->num * (HS_REGION_INTS - 1) * sizeof(*ends));
+    i = ends == NULL || sort_hs_region(&rg, ends) != 0 ? -1 :
+        build_hs_tree(&rg, root, 0);
+    SAFE_FREE(ends);
+    stop_hs_pool(&tree->arena);
+    free_hs_scratch();
+    cleanup_hs_subtrees();
+    pthread_mutex_destroy(&build.subtree_lock);
+    t_arena = NULL;
+    t_stats = NULL;
+    t_build = NULL;
+
+    if (i == 0) {
+        /* rule_set statistics */
+        printf("segment_num = ");
+        for (i = 0; i < DIM_MAX; i++) {
+            printf("%lu ", tree->stats.segment_num[i]);
+        }
+        printf("\n");
+
+        printf("\nsegment_total = %lu", tree->stats.segment_total);
+        printf("\nshared_subtrees = %lu", tree->stats.shared_num);
+
+        printf_stats_nodes(&tree->stats);
+        printf("\narena_memory = %lu", hs_arena_size(&tree->arena));
+
+        if (hs_conf.layout == HS_LAYOUT_FLAT) {
+            if (compile_hs_tree(tree) != 0) {
+                hs_cleanup(&tree);
+                *(struct hs_tree **) userdata = NULL;
+                return -1;
+            }
+            printf_stats_flat(tree, rs->num);
+        } else if (hs_conf.layout == HS_LAYOUT_WIDE) {
+            if (compile_wide_hs_tree(tree, hs_conf.wide_levels) != 0) {
+                hs_cleanup(&tree);
+                *(struct hs_tree **) userdata = NULL;
+                return -1;
+            }
+        }
+        select_hs_kernel(tree);
+
+        *(struct hs_tree **) userdata = tree;
+        return 0;
+    } else {
+        hs_cleanup(&tree);
+        *(struct hs_tree **) userdata = NULL;
+        return -1;
+    }
+}
+
+/* a leaf at @depth turned into an inner node with two leaves */
+static void count_hs_split(struct hs_stats *st, size_t depth)
+{
+    st->tree_node_num++;
+    st->leaf_node_num++;
+    st->update_nodes += 2;
+    count_hs_depth(st, depth, 0, 1);
+    count_hs_depth(st, depth, 1, -1);
+    count_hs_depth(st, depth + 1, 1, 2);
+    st->average_depth += depth + 2;
+    if (st->worst_depth < depth + 1) {
+        st->worst_depth = depth + 1;
+    }
+
+    return;
+}
+
+/* two leaves under @node, which the caller turns into an inner node */
+static int split_hs_leaf(struct hs_tree *tree, struct hs_node *node)
+{
+    struct hs_node *child;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        child = alloc_hs_node(&tree->arena);
+        if (child == NULL) {
+            return -1;
+        }
+        child->d2s = -1;
+        child->ref = 1;
+        child->depth = node->depth + 1;
+        child->height = 0;
+        child->size = 1;
+        child->base_height = 0;
+        child->base_size = 1;
+        child->thresh = node->thresh;
+        node->child[i] = child;
+    }
+    count_hs_split(&tree->stats, node->depth);
+
+    return 0;
+}
+
+/*
+ * carves @r out of leaf @node of region @box: every bound of @r inside
+ * the box splits off a leaf keeping the old priority. Returns the leaf
+ * left covered by @r, @node itself if @r covers the whole box.
+ */
+static struct hs_node *carve_hs_leaf(struct hs_tree *tree,
+        struct hs_node *node, struct rng_rule *box, struct rng_rule *r)
+{
+    int d;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (is_greater(&r->dim[d][0], &box->dim[d][0])) {
+            if (split_hs_leaf(tree, node) != 0) {
+                return NULL;
+            }
+            node->d2s = d;
+            node->thresh = r->dim[d][0];
+            point_dec(&node->thresh);
+            node = node->child[1];
+            box->dim[d][0] = r->dim[d][0];
+        }
+        if (is_less(&r->dim[d][1], &box->dim[d][1])) {
+            if (split_hs_leaf(tree, node) != 0) {
+                return NULL;
+            }
+            node->d2s = d;
+            node->thresh = r->dim[d][1];
+            node = node->child[0];
+            box->dim[d][1] = r->dim[d][1];
+        }
+    }
+
+    return node;
+}
+
+/*
+ * rules of a batch on their way down: the node they reach, its region and
+ * their slice of the index stack, in batch order
+ */
+struct hs_batch_frame {
+    struct hs_node *node;
+    struct rng_rule box;
+    int base;
+    int num;
+};
+
+struct hs_batch_stack {
+    struct hs_batch_frame *frame;
+    int frame_num;
+    int frame_cap;
+    int *idx;
+    int idx_cap;
+};
+
+/* what a batch does at a leaf, it may push frames to go on below it */
+typedef int (*hs_leaf_fn)(struct hs_tree *tree, struct hs_batch_stack *s,
+        const struct hs_batch_frame *f, struct rng_rule *rules, void *arg);
+
+/* room for @frame_num frames and @idx_num indices, doubling */
+static int grow_hs_batch_stack(struct hs_batch_stack *s, int frame_num,
+        int idx_num)
+{
+    if (frame_num > s->frame_cap && grow_hs_scratch((void **)&s->frame,
+                &s->frame_cap, frame_num << 1, sizeof(*s->frame)) != 0) {
+        return -1;
+    }
+    if (idx_num > s->idx_cap && grow_hs_scratch((void **)&s->idx,
+                &s->idx_cap, idx_num << 1, sizeof(*s->idx)) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void push_hs_batch_frame(struct hs_batch_stack *s,
+        struct hs_node *node, const struct rng_rule *box, int base, int num)
+{
+    struct hs_batch_frame *f = &s->frame[s->frame_num++];
+
+    f->node = node;
+    f->box = *box;
+    f->base = base;
+    f->num = num;
+
+    return;
+}
+
+/* the region of the root */
+static void init_hs_box(struct rng_rule *box)
+{
+    bzero(box, sizeof(*box));
+    box->dim[0][1].u32 = (1UL << 32) - 1;
+    box->dim[1][1].u32 = (1UL << 32) - 1;
+    box->dim[2][1].u16 = (1U << 16) - 1;
+    box->dim[3][1].u16 = (1U << 16) - 1;
+    box->dim[4][1].u8 = 255;
+
+    return;
+}
+
+/*
+ * carries @num rules from @node of region @box down in one walk: the
+ * batch is split at every inner node between the children the rules
+ * overlap, and @leaf gets the rules reaching each leaf in batch order. The
+ * slice of a frame is the top of the index stack when the frame is popped,
+ * so the children's slices are carved out of it in place.
+ */
+static int walk_hs_batch(struct hs_tree *tree, struct hs_node *node,
+        const struct rng_rule *box, struct rng_rule *rules, int num,
+        hs_leaf_fn leaf, void *arg)
+{
+    struct hs_batch_stack s;
+    struct hs_batch_frame f;
+    struct hs_node *child;
+    struct rng_rule cbox;
+    union point thresh;
+    int top, nl, nr, d, i, k;
+
+    if (num <= 0) {
+        return 0;
+    }
+
+    bzero(&s, sizeof(s));
+    if (grow_hs_batch_stack(&s, 64, num << 1) != 0) {
+        goto err;
+    }
+
+    for (i = 0; i < num; i++) {
+        s.idx[i] = i;
+    }
+    push_hs_batch_frame(&s, node, box, 0, num);
+
+    while (s.frame_num > 0) {
+        f = s.frame[--s.frame_num];
+        node = f.node;
+        top = f.base + f.num;
+
+        if (node->d2s == -1) {
+            if (grow_hs_batch_stack(&s, s.frame_num + 1, 0) != 0 ||
+                    leaf(tree, &s, &f, rules, arg) != 0) {
+                goto err;
+            }
+            continue;
+        }
+
+        /* rights go above the slice while lefts are packed in place */
+        if (grow_hs_batch_stack(&s, s.frame_num + 2, top + f.num) != 0) {
+            goto err;
+        }
+        d = node->d2s;
+        thresh = node->thresh;
+        for (nl = nr = i = 0; i < f.num; i++) {
+            k = s.idx[f.base + i];
+            if (!is_less(&thresh, &rules[k].dim[d][0])) {
+                s.idx[f.base + nl++] = k;
+            }
+            if (is_less(&thresh, &rules[k].dim[d][1])) {
+                s.idx[top + nr++] = k;
+            }
+        }
+        memmove(&s.idx[f.base + nl], &s.idx[top], nr * sizeof(*s.idx));
+
+        /* shared subtrees are copied before they can be changed */
+        if (nl > 0) {
+            if ((child = own_hs_child(tree, node, 0)) == NULL) {
+                goto err;
+            }
+            cbox = f.box;
+            cbox.dim[d][1] = thresh;
+            push_hs_batch_frame(&s, child, &cbox, f.base, nl);
+        }
+        if (nr > 0) {
+            if ((child = own_hs_child(tree, node, 1)) == NULL) {
+                goto err;
+            }
+            cbox = f.box;
+            cbox.dim[d][0] = thresh;
+            point_inc(&cbox.dim[d][0]);
+            push_hs_batch_frame(&s, child, &cbox, f.base + nl, nr);
+        }
+    }
+
+    SAFE_FREE(s.frame);
+    SAFE_FREE(s.idx);
+    return 0;
+
+err:
+    SAFE_FREE(s.frame);
+    SAFE_FREE(s.idx);
+    return -1;
+}
+
+/* @r cut to the region @box */
+static void trim_hs_rule(struct rng_rule *r, const struct rng_rule *box)
+{
+    int d;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (is_less(&r->dim[d][0], (union point *)&box->dim[d][0])) {
+            r->dim[d][0] = box->dim[d][0];
+        }
+        if (is_greater(&r->dim[d][1], (union point *)&box->dim[d][1])) {
+            r->dim[d][1] = box->dim[d][1];
+        }
+    }
+
+    return;
+}
+
+/*
+ * leaves of an insertion, as if the rules came one at a time: a rule
+ * beating the leaf carves itself out, and the rest of the batch goes
+ * down what it carved
+ */
+static int insrt_hs_leaf(struct hs_tree *tree, struct hs_batch_stack *s,
+        const struct hs_batch_frame *f, struct rng_rule *rules, void *arg)
+{
+    struct hs_node *node = f->node, *child;
+    struct rng_rule *r, box;
+    int i;
+
+    for (i = 0; i < f->num; i++) {
+        r = &rules[s->idx[f->base + i]];
+
+        /* a bucket takes the rule as cut by the leaf region, whatever its priority */
+        if (node->bucket != NULL) {
+            box = *r;
+            trim_hs_rule(&box, &f->box);
+            tree->stats.bucket_memory -= hs_bucket_size(node->bucket);
+            if (insrt_hs_bucket(&tree->arena, &node->bucket, &box) != 0) {
+                return -1;
+            }
+            tree->stats.bucket_memory += hs_bucket_size(node->bucket);
+            tree->stats.bucket_rules++;
+            node->thresh.u32 = node->bucket->pri[0];
+            continue;
+        }
+        if (r->pri >= node->thresh.u32) {
+            continue;
+        }
+
+        box = f->box;
+        if ((child = carve_hs_leaf(tree, node, &box, r)) == NULL) {
+            return -1;
+        }
+        child->thresh.u32 = r->pri;
+
+        if (child != node) {
+            if (i + 1 < f->num) {
+                push_hs_batch_frame(s, node, &f->box, f->base + i + 1,
+                        f->num - i - 1);
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * rules held by the tree
+ */
+static int hs_rule_cmp(const void *a, const void *b)
+{
+    return ((const struct hs_rule *)a)->pri - ((const struct hs_rule *)b)->pri;
+}
+
+static void set_hs_rule(struct hs_rule *h, const struct rng_rule *r)
+{
+    int d;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        h->lo[d] = r->dim[d][0].u32;
+        h->hi[d] = r->dim[d][1].u32;
+    }
+    h->pri = r->pri;
+
+    return;
+}
+
+static void get_hs_rule(struct rng_rule *r, const struct hs_rule *h)
+{
+    int d;
+
+    bzero(r, sizeof(*r));
+    for (d = 0; d < DIM_MAX; d++) {
+        r->dim[d][0].u32 = h->lo[d];
+        r->dim[d][1].u32 = h->hi[d];
+    }
+    r->pri = h->pri;
+
+    return;
+}
+
+/* first rule of priority @pri or worse */
+static size_t find_hs_rule(const struct hs_tree *tree, int pri)
+{
+    size_t lo = 0, hi = tree->rule_num, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (tree->rules[mid].pri < pri) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* merges @num rules into the priority ordered ones of @tree */
+static int add_hs_rules(struct hs_tree *tree, const struct rng_rule *rules,
+        int num)
+{
+    struct hs_rule *added, *grown;
+    size_t cap;
+    long i, j, k;
+
+    if ((added = malloc(num * sizeof(*added))) == NULL) {
+        return -1;
+    }
+    if (tree->rule_num + num > tree->rule_cap) {
+        cap = (tree->rule_num + num) << 1;
+        if ((grown = realloc(tree->rules, cap * sizeof(*grown))) == NULL) {
+            free(added);
+            return -1;
+        }
+        tree->rules = grown;
+        tree->rule_cap = cap;
+    }
+
+    for (i = 0; i < num; i++) {
+        set_hs_rule(&added[i], &rules[i]);
+    }
+    qsort(added, num, sizeof(*added), hs_rule_cmp);
+
+    /* from the back, the held rules only move up */
+    i = tree->rule_num - 1;
+    k = tree->rule_num + num - 1;
+    for (j = num - 1; j >= 0; k--) {
+        if (i >= 0 && tree->rules[i].pri > added[j].pri) {
+            tree->rules[k] = tree->rules[i--];
+        } else {
+            tree->rules[k] = added[j--];
+        }
+    }
+    tree->rule_num += num;
+    free(added);
+
+    return 0;
+}
+
+static int hs_rule_meets(const struct hs_rule *h, const struct rng_rule *box)
+{
+    int d;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (h->lo[d] > box->dim[d][1].u32 || h->hi[d] < box->dim[d][0].u32) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int hs_rule_covers(const struct hs_rule *h, const struct rng_rule *box)
+{
+    int d;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (h->lo[d] > box->dim[d][0].u32 || h->hi[d] < box->dim[d][1].u32) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * localized rebuilds: after an update the subtrees on the paths it took
+ * are checked bottom up, and one the updates made deeper or bigger than
+ * the ratios of hs_conf allow over what it was built as is built again
+ * from the rules it covers. The smallest degraded subtrees go first. A
+ * subtree carved by the updates was built as a leaf, it is measured
+ * against log2 of its rules and one node per rule instead.
+ */
+static int hs_degraded(const struct hs_node *node, int num)
+{
+    /* about log2 of the rules */
+    uint32_t bits = 32 - __builtin_clz(num);
+    uint32_t height = node->base_height > bits ? node->base_height : bits;
+    uint32_t size = node->base_size > num ? node->base_size : num;
+
+    if (hs_conf.rebuild_depth > 0 &&
+            node->height > hs_conf.rebuild_depth * height) {
+        return 1;
+    }
+    if (hs_conf.rebuild_nodes > 0 &&
+            node->size > hs_conf.rebuild_nodes * size) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * what the rebuilds below changed of @node is taken into what it was built
+ * as, only the updates count against it. @height and @size are what it
+ * would be had the rebuilt subtrees stayed as built.
+ */
+static void rebase_hs_node(struct hs_node *node, uint32_t height,
+        uint32_t size)
+{
+    int64_t h = (int64_t)node->base_height + node->height - height;
+    int64_t s = (int64_t)node->base_size + node->size - size;
+
+    node->base_height = h > 0 ? h : 0;
+    node->base_size = s > 1 ? s : 1;
+
+    return;
+}
+
+/*
+ * takes the nodes under @node out of the stats and gives them and their
+ * buckets back to the arena, shared subtrees lose a parent. @node itself
+ * is left to be built again.
+ */
+static void release_hs_subtree(struct hs_tree *tree, struct hs_node *node)
+{
+    struct hs_stats *st = &tree->stats;
+    int i;
+
+    if (node->child[0] == NULL && node->child[1] == NULL) {
+        st->leaf_node_num--;
+        st->average_depth -= node->depth;
+        count_hs_depth(st, node->depth, 1, -1);
+        if (node->bucket != NULL) {
+            st->bucket_num--;
+            st->bucket_rules -= node->bucket->num;
+            st->bucket_memory -= hs_bucket_size(node->bucket);
+            free_hs_bucket(&tree->arena, node->bucket);
+            node->bucket = NULL;
+        }
+        return;
+    }
+
+    st->tree_node_num--;
+    count_hs_depth(st, node->depth, 0, -1);
+    for (i = 0; i < 2; i++) {
+        if (node->child[i]->ref > 1) {
+            node->child[i]->ref--;
+        } else {
+            release_hs_subtree(tree, node->child[i]);
+            free_hs_node(&tree->arena, node->child[i]);
+        }
+        node->child[i] = NULL;
+    }
+
+    return;
+}
+
+/* builds the subtree at @node of region @box again from the @num held rules in @held */
+static int rebuild_hs_subtree(struct hs_tree *tree, struct hs_node *node,
+        const struct rng_rule *box, const int *held, int num)
+{
+    struct rule_set rs = {NULL, NULL, num};
+    struct hs_build build;
+    struct hs_region rg;
+    int *ends = NULL;
+    int ret = -1, d, i;
+
+    if ((rs.r_rules = malloc(num * sizeof(*rs.r_rules))) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        get_hs_rule(&rs.r_rules[i], &tree->rules[held[i]]);
+    }
+
+    release_hs_subtree(tree, node);
+    while (tree->stats.worst_depth > 0 &&
+            hs_depth_num(&tree->stats, tree->stats.worst_depth, 0) +
+            hs_depth_num(&tree->stats, tree->stats.worst_depth, 1) == 0) {
+        tree->stats.worst_depth--;
+    }
+    if (node->depth == 0) {
+        tree->stats.segment_total = 1;
+    }
+
+    bzero(&build, sizeof(build));
+    pthread_mutex_init(&build.subtree_lock, NULL);
+    build.memory = hs_tree_memory(&tree->stats);
+
+    t_build = &build;
+    t_stats = &tree->stats;
+    t_arena = &tree->arena;
+    if (num >= HS_TASK_RULES) {
+        start_hs_pool(hs_conf.threads);
+    }
+    init_hs_region(&rg, &rs);
+    for (d = 0; d < DIM_MAX; d++) {
+        rg.box[d][0] = box->dim[d][0];
+        rg.box[d][1] = box->dim[d][1];
+    }
+    if ((ends = malloc(num * (HS_REGION_INTS - 1) * sizeof(*ends))) != NULL &&
+            sort_hs_region(&rg, ends) == 0) {
+        ret = build_hs_tree(&rg, node, node->depth);
+    }
+    stop_hs_pool(&tree->arena);
+    free_hs_scratch();
+    pthread_mutex_destroy(&build.subtree_lock);
+    t_arena = NULL;
+    t_stats = NULL;
+    t_build = NULL;
+
+    tree->stats.rebuild_num++;
+    tree->stats.rebuild_rules += num;
+    SAFE_FREE(ends);
+    SAFE_FREE(rs.r_rules);
+    return ret;
+}
+
+/*
+ * @held are the held rules meeting @box, @batch the updated rules the
+ * walk took to @node: the children they reach are checked first. What
+ * the ancestors should count @node as goes back in @height and @size: a
+ * rebuilt subtree counts as what it was built as before, so neither the
+ * rebuild nor the growth it undid counts against them.
+ */
+static int check_hs_subtree(struct hs_tree *tree, struct hs_node *node,
+        const struct rng_rule *box, const int *held, int num,
+        const struct rng_rule *rules, const int *batch, int batch_num,
+        uint32_t *height, uint32_t *size)
+{
+    struct rng_rule cbox;
+    union point thresh, *r;
+    uint32_t ch[2], cs[2];
+    int *buf, *chld, *cbatch, cnum, cbatch_num, d, i, k;
+
+    *height = node->height;
+    *size = node->size;
+    if (node->child[0] == NULL && node->child[1] == NULL) {
+        return 0;
+    }
+    if ((buf = malloc((num + batch_num) * sizeof(*buf))) == NULL) {
+        return -1;
+    }
+    chld = buf;
+    cbatch = buf + num;
+    d = node->d2s;
+    thresh = node->thresh;
+
+    for (k = 0; k < 2; k++) {
+        ch[k] = node->child[k]->height;
+        cs[k] = node->child[k]->size;
+        cbox = *box;
+        if (k == 0) {
+            cbox.dim[d][1] = thresh;
+        } else {
+            cbox.dim[d][0] = thresh;
+            point_inc(&cbox.dim[d][0]);
+        }
+
+        /* shared subtrees were copied on the way if the batch got there */
+        for (cbatch_num = i = 0; i < batch_num; i++) {
+            r = (union point *)rules[batch[i]].dim[d];
+            if (k == 0 ? !is_less(&thresh, &r[0]) : is_less(&thresh, &r[1])) {
+                cbatch[cbatch_num++] = batch[i];
+            }
+        }
+        if (cbatch_num == 0 || node->child[k]->ref > 1) {
+            continue;
+        }
+        for (cnum = i = 0; i < num; i++) {
+            if (tree->rules[held[i]].lo[d] <= cbox.dim[d][1].u32 &&
+                    tree->rules[held[i]].hi[d] >= cbox.dim[d][0].u32) {
+                chld[cnum++] = held[i];
+            }
+        }
+        if (check_hs_subtree(tree, node->child[k], &cbox, chld, cnum,
+                    rules, cbatch, cbatch_num, &ch[k], &cs[k]) != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+
+    set_hs_height(node);
+    *height = (ch[0] > ch[1] ? ch[0] : ch[1]) + 1;
+    *size = cs[0] + cs[1] + 1;
+    rebase_hs_node(node, *height, *size);
+    if (num > 0 && hs_degraded(node, num)) {
+        *height = node->base_height;
+        *size = node->base_size;
+        return rebuild_hs_subtree(tree, node, box, held, num);
+    }
+
+    return 0;
+}
+
+static int check_hs_tree(struct hs_tree *tree, const struct rng_rule *rules,
+        int num)
+{
+    struct rng_rule box;
+    uint32_t height, size;
+    int *held, *batch, i, ret;
+
+    if (hs_conf.rebuild_depth <= 0 && hs_conf.rebuild_nodes <= 0) {
+        return 0;
+    }
+
+    held = malloc(tree->rule_num * sizeof(*held));
+    batch = malloc(num * sizeof(*batch));
+    if (held == NULL || batch == NULL) {
+        SAFE_FREE(held);
+        SAFE_FREE(batch);
+        return -1;
+    }
+    for (i = 0; i < tree->rule_num; i++) {
+        held[i] = i;
+    }
+    for (i = 0; i < num; i++) {
+        batch[i] = i;
+    }
+
+    init_hs_box(&box);
+    ret = check_hs_subtree(tree, tree->root, &box, held, tree->rule_num,
+            rules, batch, num, &height, &size);
+    free(held);
+    free(batch);
+
+    return ret;
+}
+
+static int insrt_hs_rules(struct hs_tree *tree, struct rng_rule *rules,
+        int num)
+{
+    struct rng_rule box;
+
+    if (add_hs_rules(tree, rules, num) != 0) {
+        return -1;
+    }
+    init_hs_box(&box);
+    if (walk_hs_batch(tree, tree->root, &box, rules, num, insrt_hs_leaf,
+                NULL) != 0) {
+        return -1;
+    }
+
+    return check_hs_tree(tree, rules, num);
+}
+
+/*
+ * deletion: leaves won by a deleted rule are noted and given the next best
+ * once all rules of the batch are gone. Splits are kept.
+ */
+struct hs_dirty_leaf {
+    struct hs_node *node;
+    struct rng_rule box;
+    int pri;                    /* best one deleted from the leaf */
+};
+
+struct hs_dirty_list {
+    struct hs_dirty_leaf *leaf;
+    int num;
+    int cap;
+};
+
+/* the entry @r left in bucket @b, -1 if there is none */
+static int find_hs_bucket(const struct hs_bucket *b, const struct rng_rule *r)
+{
+    int d, i;
+
+    for (i = 0; i < b->num; i++) {
+        if (b->pri[i] != r->pri) {
+            continue;
+        }
+        for (d = 0; d < DIM_MAX; d++) {
+            if (b->lo[d][i] > r->dim[d][1].u32 ||
+                    b->hi[d][i] < r->dim[d][0].u32) {
+                break;
+            }
+        }
+        if (d == DIM_MAX) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* drops the entries of priority @pri or worse, their slots are padded again */
+static int cut_hs_bucket(struct hs_bucket *b, int pri)
+{
+    int d, i, num = b->num;
+
+    for (i = 0; i < b->num && b->pri[i] < pri; i++) {
+        ;
+    }
+    for (b->num = i; i < num; i++) {
+        for (d = 0; d < DIM_MAX; d++) {
+            b->lo[d][i] = UINT32_MAX;
+            b->hi[d][i] = 0;
+        }
+        b->pri[i] = -1;
+    }
+
+    return num - b->num;
+}
+
+/*
+ * a leaf whose winner or bucket entries went is noted once, with the best
+ * priority deleted from it
+ */
+static int delete_hs_leaf(struct hs_tree *tree, struct hs_batch_stack *s,
+        const struct hs_batch_frame *f, struct rng_rule *rules, void *arg)
+{
+    struct hs_dirty_list *dirty = arg;
+    struct hs_node *node = f->node;
+    struct rng_rule *r;
+    int i, pri = -1;
+
+    for (i = 0; i < f->num; i++) {
+        r = &rules[s->idx[f->base + i]];
+
+        if (node->bucket != NULL) {
+            if (find_hs_bucket(node->bucket, r) < 0) {
+                continue;
+            }
+        } else if (node->thresh.u32 != r->pri) {
+            continue;
+        }
+        if (pri == -1 || pri > r->pri) {
+            pri = r->pri;
+        }
+    }
+    if (pri == -1) {
+        return 0;
+    }
+
+    if (dirty->num == dirty->cap && grow_hs_scratch((void **)&dirty->leaf,
+                &dirty->cap, (dirty->cap + 16) << 1,
+                sizeof(*dirty->leaf)) != 0) {
+        return -1;
+    }
+    dirty->leaf[dirty->num].node = node;
+    dirty->leaf[dirty->num].box = f->box;
+    dirty->leaf[dirty->num].pri = pri;
+    dirty->num++;
+
+    return 0;
+}
+
+/*
+ * the held rules meeting the leaf are at least as bad as the deleted
+ * winner. The first one covering the whole leaf wins it, better ones only
+ * meeting part of it are carved in as an insertion would. Without such a
+ * rule the leaf becomes a bucket of what meets it. A bucket keeps its
+ * entries better than the deleted ones and is refilled from the held
+ * rules up to the covering one: its build may have left out rules behind
+ * a rule covering less than the leaf, and inserts may already hold the
+ * rest.
+ */
+static int repair_hs_leaf(struct hs_tree *tree, struct hs_dirty_leaf *dl,
+        struct rng_rule **part, int *part_cap)
+{
+    struct hs_node *node = dl->node;
+    const struct hs_rule *h;
+    struct rng_rule r;
+    size_t k;
+    int num = 0, i;
+
+    if (node->bucket != NULL) {
+        tree->stats.bucket_memory -= hs_bucket_size(node->bucket);
+        tree->stats.bucket_rules -= cut_hs_bucket(node->bucket, dl->pri);
+        for (k = find_hs_rule(tree, dl->pri); k < tree->rule_num; k++) {
+            h = &tree->rules[k];
+            if (!hs_rule_meets(h, &dl->box)) {
+                continue;
+            }
+            get_hs_rule(&r, h);
+            trim_hs_rule(&r, &dl->box);
+            if (insrt_hs_bucket(&tree->arena, &node->bucket, &r) != 0) {
+                return -1;
+            }
+            tree->stats.bucket_rules++;
+            if (hs_rule_covers(h, &dl->box)) {
+                break;
+            }
+        }
+        tree->stats.bucket_memory += hs_bucket_size(node->bucket);
+        if (node->bucket->num > 0) {
+            node->thresh.u32 = node->bucket->pri[0];
+        }
+        return 0;
+    }
+
+    for (k = find_hs_rule(tree, dl->pri); k < tree->rule_num; k++) {
+        h = &tree->rules[k];
+        if (!hs_rule_meets(h, &dl->box)) {
+            continue;
+        }
+        if (hs_rule_covers(h, &dl->box)) {
+            break;
+        }
+        if (num == *part_cap && grow_hs_scratch((void **)part, part_cap,
+                    (*part_cap + 16) << 1, sizeof(**part)) != 0) {
+            return -1;
+        }
+        get_hs_rule(&(*part)[num++], h);
+    }
+
+    if (k < tree->rule_num) {
+        node->thresh.u32 = tree->rules[k].pri;
+        return walk_hs_batch(tree, node, &dl->box, *part, num,
+                insrt_hs_leaf, NULL);
+    }
+
+    if ((node->bucket = alloc_hs_bucket(&tree->arena, num ? num : 1)) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        trim_hs_rule(&(*part)[i], &dl->box);
+        if (insrt_hs_bucket(&tree->arena, &node->bucket, &(*part)[i]) != 0) {
+            return -1;
+        }
+    }
+    if (num > 0) {
+        node->thresh.u32 = node->bucket->pri[0];
+    }
+    tree->stats.bucket_num++;
+    tree->stats.bucket_rules += num;
+    tree->stats.bucket_memory += hs_bucket_size(node->bucket);
+
+    return 0;
+}
+
+/* takes the rules of @rs out of the held ones, returns them in @gone */
+static int take_hs_rules(struct hs_tree *tree, const struct rule_set *rs,
+        struct rng_rule *gone)
+{
+    struct hs_rule h;
+    uint8_t *dead;
+    size_t i, j, k;
+    int num = 0, n;
+
+    if ((dead = calloc(tree->rule_num, sizeof(*dead))) == NULL) {
+        return -1;
+    }
+
+    for (n = 0; n < rs->num; n++) {
+        set_hs_rule(&h, &rs->r_rules[n]);
+        for (k = find_hs_rule(tree, h.pri);
+                k < tree->rule_num && tree->rules[k].pri == h.pri; k++) {
+            if (!dead[k] && memcmp(&tree->rules[k], &h, sizeof(h)) == 0) {
+                dead[k] = 1;
+                gone[num++] = rs->r_rules[n];
+                break;
+            }
+        }
+    }
+
+    for (i = j = 0; i < tree->rule_num; i++) {
+        if (!dead[i]) {
+            tree->rules[j++] = tree->rules[i];
+        }
+    }
+    tree->rule_num = j;
+    free(dead);
+
+    return num;
+}
+
+int hs_insrt_rule(struct rng_rule *p_r, void *userdata)
+{
+    return insrt_hs_rules(*(struct hs_tree **)userdata, p_r, 1);
+}
+
+
+int hs_insrt_update(const struct rule_set *rs, void *userdata)
+{
+    if (!*(void **) userdata || !rs->r_rules) return -1;
+    struct hs_tree *tree = *(typeof(tree) *)userdata;
+    size_t arena_size = hs_arena_size(&tree->arena);
+
+    if (insrt_hs_rules(tree, rs->r_rules, rs->num) != 0) {
+        return -1;
+    }
+    tree->stats.update_rules += rs->num;
+    tree->stats.update_memory += hs_arena_size(&tree->arena) - arena_size;
+
+    printf_stats_nodes(&tree->stats);
+    printf("\nupdate_rules = %lu", tree->stats.update_rules);
+    printf("\nupdate_nodes = %lu", tree->stats.update_nodes);
+    printf("\nupdate_memory = %lu", tree->stats.update_memory);
+    printf("\nrebuilt_subtrees = %lu", tree->stats.rebuild_num);
+    printf("\nrebuilt_rules = %lu\n", tree->stats.rebuild_rules);
+
+    /* the compiled array is a snapshot, redo it after the tree changed */
+    if (tree->flat != NULL && compile_hs_tree(tree) != 0) {
+        return -1;
+    }
+    if (tree->wide != NULL &&
+            compile_wide_hs_tree(tree, hs_conf.wide_levels) != 0) {
+        return -1;
+    }
 
-        /*
-         * gen heuristic info
-         */
-        for (wght_all = 0, i = 0; i < pnt_num - 1; i++) {
-            for (wght[i] = 0, j = 0; j < rs->num; j++) {
-                if (is_less_equal(&rs->r_rules[j].dim[d][0],
-                        &seg_pnts[i].pnt) &&
-                    is_greater_equal(&rs->r_rules[j].dim[d][1],
-                        &seg_pnts[i + 1].pnt)) {
-                    wght[i]++;
-                    wght_all++;
-                }
-            }
-        }
+    return 0;
+}
 
-        wght_jdg = (float)wght_all / (pnt_num - 1);
+/* rules of @rs the tree does not hold are skipped */
+int hs_delete_update(const struct rule_set *rs, void *userdata)
+{
+    if (!*(void **) userdata || !rs->r_rules) return -1;
+    struct hs_tree *tree = *(typeof(tree) *)userdata;
+    size_t arena_size = hs_arena_size(&tree->arena);
+    struct hs_dirty_list dirty = {NULL, 0, 0};
+    struct rng_rule *gone, *part = NULL, box;
+    int num, part_cap = 0, ret = -1, i;
+
+    if ((gone = malloc(rs->num * sizeof(*gone))) == NULL ||
+            (num = take_hs_rules(tree, rs, gone)) < 0) {
+        SAFE_FREE(gone);
+        return -1;
+    }
 
-        if (wght_avg <= wght_jdg) {
-            continue; /* skip this dim: the less the better */
+    init_hs_box(&box);
+    if (walk_hs_batch(tree, tree->root, &box, gone, num, delete_hs_leaf,
+                &dirty) != 0) {
+        goto out;
+    }
+    for (i = 0; i < dirty.num; i++) {
+        if (repair_hs_leaf(tree, &dirty.leaf[i], &part, &part_cap) != 0) {
+            goto out;
         }
+    }
+    if (check_hs_tree(tree, gone, num) != 0) {
+        goto out;
+    }
+    tree->stats.delete_rules += num;
+    tree->stats.update_memory += hs_arena_size(&tree->arena) - arena_size;
+
+    printf("%d of %d rules deleted, %d leaves repaired\n", num, rs->num,
+            dirty.num);
+    printf_stats_nodes(&tree->stats);
+    printf("\ndelete_rules = %lu", tree->stats.delete_rules);
+    printf("\nupdate_nodes = %lu", tree->stats.update_nodes);
+    printf("\nupdate_memory = %lu", tree->stats.update_memory);
+    printf("\nrebuilt_subtrees = %lu", tree->stats.rebuild_num);
+    printf("\nrebuilt_rules = %lu\n", tree->stats.rebuild_rules);
+
+    if (tree->flat != NULL && compile_hs_tree(tree) != 0) {
+        goto out;
+    }
+    if (tree->wide != NULL &&
+            compile_wide_hs_tree(tree, hs_conf.wide_levels) != 0) {
+        goto out;
+    }
+    ret = 0;
 
-        /*
-         * found dimension candidate
-         */
-        d2s = d, wght_avg = wght_jdg;
-
-        for (wght_jdg = wght[0], i = 1; i < pnt_num - 1;
-            wght_jdg += wght[i], i++) {
+out:
+    SAFE_FREE(gone);
+    SAFE_FREE(part);
+    SAFE_FREE(dirty.leaf);
+    return ret;
+}
 
-            thresh = seg_pnts[i].pnt;
-            if (seg_pnts[i].flag.begin) {
-                point_dec(&thresh);
-            }
+/*
+ * bucket scans: rules are in priority order, the first hit is the match
+ */
+static int hs_bucket_scan_scalar(const struct hs_bucket *b,
+        const struct packet *pkt)
+{
+    uint32_t val;
+    int d, i;
 
-            if (wght_jdg > (wght_all / 2.f)) {
-                break; /* reach the half of the wght */
+    for (i = 0; i < b->num; i++) {
+        for (d = 0; d < DIM_MAX; d++) {
+            val = pkt->val[d].u32;
+            if (val < b->lo[d][i] || val > b->hi[d][i]) {
+                break;
             }
         }
+        if (d == DIM_MAX) {
+            return b->pri[i];
+        }
+    }
 
-        lrange.begin = seg_pnts[0].pnt;
-        lrange.end = thresh;
-
-        rrange.begin = thresh;
-        point_inc(&rrange.begin);
-        rrange.end = seg_pnts[pnt_num - 1].pnt;
+    return -1;
+}
 
-    } /* end of for (d = 0; d < DIM_MAX; d++) */
+/* lo <= val <= hi as max(val, lo) == val and min(val, hi) == val */
+__attribute__((target("avx2")))
+static int hs_bucket_scan_avx2(const struct hs_bucket *b,
+        const struct packet *pkt)
+{
+    __m256i val[DIM_MAX], hit, lo, hi;
+    int d, i, m;
 
-    SAFE_FREE(seg_pnts);
-    SAFE_FREE(wght);
+    for (d = 0; d < DIM_MAX; d++) {
+        val[d] = _mm256_set1_epi32(pkt->val[d].u32);
+    }
 
-    /*
-     * gen leaf node
-     */
-    if (max_pnt < 3) {
-        cur_node->d2s = -1;
-        cur_node->depth = depth;
-        cur_node->thresh.u64 = rs->r_rules[0].pri;
-        cur_node->child[0] = NULL;
-        cur_node->child[1] = NULL;
+    for (i = 0; i < b->num; i += HS_BUCKET_LANES) {
+        hit = _mm256_set1_epi32(-1);
+        for (d = 0; d < DIM_MAX; d++) {
+            lo = _mm256_load_si256((const __m256i *)&b->lo[d][i]);
+            hi = _mm256_load_si256((const __m256i *)&b->hi[d][i]);
+            hit = _mm256_and_si256(hit, _mm256_and_si256(
+                    _mm256_cmpeq_epi32(_mm256_max_epu32(val[d], lo), val[d]),
+                    _mm256_cmpeq_epi32(_mm256_min_epu32(val[d], hi), val[d])));
+        }
 
-        SAFE_FREE(child_rs.r_rules);
-        g_statistics.leaf_node_num++;
-        g_statistics.depth_node[depth][1]++;
-        g_statistics.average_depth += depth;
-        if (g_statistics.worst_depth < depth) {
-            g_statistics.worst_depth = depth;
+        m = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+        if (m != 0) {
+            return b->pri[i + __builtin_ctz(m)];
         }
-        return 0;
     }
 
-    cur_node->d2s = d2s;
-    build_estimator.choose[d2s]++;
-    build_estimator.choose_num++;
-    build_estimator.avg_choose_depth+=depth;
-    cur_node->depth = depth;
-    cur_node->thresh = thresh;
+    return -1;
+}
 
 
-    /*
-     * gen left child
-     */
-    cur_node->child[0] = malloc(sizeof(*cur_node->child[0]));
-    if (cur_node->child[0] == NULL) {
-        SAFE_FREE(child_rs.r_rules);
-        return -1;
+static inline int hs_flat_classify(const struct hs_tree *tree,
+        const struct packet *pkt)
+{
+    const struct hs_flat_node *flat = tree->flat, *node = flat;
+
+    while (node->dim < HS_BUCKET_DIM) {
+        node = &flat[node->child + (pkt->val[node->dim].u32 > node->thresh)];
     }
 
-    bzero(child_rs.r_rules, rs->num * sizeof(*child_rs.r_rules));
+    if (node->dim == HS_BUCKET_DIM) {
+        return tree->bucket_scan(tree->buckets[node->thresh], pkt);
+    }
+    return node->thresh;
+}
 
-    for (i = 0, child_rs.num = 0; i < rs->num; i++) {
-        if (is_greater(&rs->r_rules[i].dim[d2s][0], &lrange.end) ||
-            is_less(&rs->r_rules[i].dim[d2s][1], &lrange.begin)) {
-            continue;
+/*
+ * wide node lookups: the child to follow is the number of thresholds
+ * below the packet field, the padding UINT32_MAX never counts
+ */
+static int hs_wide_classify_scalar(const uint32_t *wide, int fanout,
+        const struct packet *pkt)
+{
+    const uint32_t *node = wide;
+    uint32_t val, ref;
+    int i, k;
+
+    for (;;) {
+        val = pkt->val[node[fanout - 1]].u32;
+        for (k = 0, i = 0; i < fanout - 1; i++) {
+            k += val > node[i];
         }
 
-        child_rs.r_rules[child_rs.num] = rs->r_rules[i];
-
-        /* rules must be trimmed */
-        if (is_less(&child_rs.r_rules[child_rs.num].dim[d2s][0],
-            &lrange.begin)) {
-            child_rs.r_rules[child_rs.num].dim[d2s][0] = lrange.begin;
+        ref = node[fanout + k];
+        if (ref & HS_WIDE_LEAF) {
+            return ref & ~HS_WIDE_LEAF;
         }
-        if (is_greater(&child_rs.r_rules[child_rs.num].dim[d2s][1],
-            &lrange.end)) {
-            child_rs.r_rules[child_rs.num].dim[d2s][1] = lrange.end;
+        node = &wide[ref * (fanout << 1)];
+    }
+}
+
+__attribute__((target("avx2,popcnt")))
+static int hs_wide_classify_avx2(const uint32_t *wide, int fanout,
+        const struct packet *pkt)
+{
+    const uint32_t *node = wide;
+    const int mask = (1 << (fanout - 1)) - 1;
+    const __m256i sign = _mm256_set1_epi32(0x80000000);
+    __m256i val;
+    uint32_t ref;
+    int gt;
+
+    for (;;) {
+        /* unsigned compare through the sign flip, the dim word is masked */
+        val = _mm256_xor_si256(
+                _mm256_set1_epi32(pkt->val[node[fanout - 1]].u32), sign);
+
+        if (fanout == 4) {
+            gt = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(
+                    _mm256_castsi256_si128(val), _mm_xor_si128(
+                        _mm_load_si128((const __m128i *)node),
+                        _mm256_castsi256_si128(sign)))));
+        } else {
+            gt = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(
+                    val, _mm256_xor_si256(
+                        _mm256_load_si256((const __m256i *)node), sign))));
+            if (fanout == 16) {
+                gt |= _mm256_movemask_ps(_mm256_castsi256_ps(
+                        _mm256_cmpgt_epi32(val, _mm256_xor_si256(
+                            _mm256_load_si256((const __m256i *)&node[8]),
+                            sign)))) << 8;
+            }
         }
 
-        child_rs.num++;
+        ref = node[fanout + __builtin_popcount(gt & mask)];
+        if (ref & HS_WIDE_LEAF) {
+            return ref & ~HS_WIDE_LEAF;
+        }
+        node = &wide[ref * (fanout << 1)];
     }
+}
 
-    if (build_hs_tree(&child_rs, cur_node->child[0], depth + 1) != 0) {
-        SAFE_FREE(cur_node->child[0]);
-        SAFE_FREE(child_rs.r_rules);
-        return -1;
-    }
+__attribute__((target("avx512f,popcnt")))
+static int hs_wide_classify_avx512(const uint32_t *wide, int fanout,
+        const struct packet *pkt)
+{
+    const uint32_t *node = wide;
+    __mmask16 gt;
+    uint32_t ref;
 
-    /*
-     * gen right child
-     */
-    cur_node->child[1] = malloc(sizeof(*cur_node->child[1]));
-    if (cur_node->child[1] == NULL) {
-        SAFE_FREE(child_rs.r_rules);
-        return -1;
+    if (fanout != 16) {
+        return hs_wide_classify_avx2(wide, fanout, pkt);
     }
 
-    bzero(child_rs.r_rules, rs->num * sizeof(*child_rs.r_rules));
+    for (;;) {
+        gt = _mm512_cmpgt_epu32_mask(
+                _mm512_set1_epi32(pkt->val[node[15]].u32),
+                _mm512_load_si512(node));
 
-    for (i = 0, child_rs.num = 0; i < rs->num; i++) {
-        if (is_greater(&rs->r_rules[i].dim[d2s][0], &rrange.end) ||
-            is_less(&rs->r_rules[i].dim[d2s][1], &rrange.begin)) {
-            continue;
+        ref = node[16 + __builtin_popcount(gt & 0x7fff)];
+        if (ref & HS_WIDE_LEAF) {
+            return ref & ~HS_WIDE_LEAF;
         }
+        node = &wide[ref << 5];
+    }
+}
 
-        child_rs.r_rules[child_rs.num] = rs->r_rules[i];
 
-        /* rules must be trimmed */
-        if (is_less(&child_rs.r_rules[child_rs.num].dim[d2s][0],
-            &rrange.begin)) {
-            child_rs.r_rules[child_rs.num].dim[d2s][0] = rrange.begin;
-        }
-        if (is_greater(&child_rs.r_rules[child_rs.num].dim[d2s][1],
-            &rrange.end)) {
-            child_rs.r_rules[child_rs.num].dim[d2s][1] = rrange.end;
-        }
+int hs_classify(const struct packet *pkt, const void *userdata)
+{
+    const struct hs_tree *tree = *(typeof(tree) *)userdata;
+    struct hs_node *node = tree->root;
 
-        child_rs.num++;
-    }
+    int ret;
 
-    if (build_hs_tree(&child_rs, cur_node->child[1], depth + 1) != 0) {
-        SAFE_FREE(cur_node->child[1]);
-        SAFE_FREE(child_rs.r_rules);
-        return -1;
+    if (tree->flat != NULL) {
+        return hs_flat_classify(tree, pkt);
+    }
+    if (tree->wide != NULL) {
+        ret = tree->wide_classify(tree->wide, tree->wide_fanout, pkt);
+        if (ret & HS_WIDE_BUCKET) {
+            return tree->bucket_scan(tree->buckets[ret & ~HS_WIDE_BUCKET], pkt);
+        }
+        return ret;
     }
 
-    SAFE_FREE(child_rs.r_rules);
-    g_statistics.tree_node_num++;
-    g_statistics.depth_node[depth][0]++;
-    return 0;
+    while (node->child[0] != NULL || node->child[1] != NULL) {
+        //printf("d2s:%d; pkt->val[%d].u32:%u; node.thresh.u32:%u\n", node->d2s, node->d2s, pkt->val[node->d2s].u32, node->thresh.u32);
+        if (pkt->val[node->d2s].u32 <= node->thresh.u32) {
+            //printf("left\n");
+            node = node->child[0];
+        } else {
+            //printf("right\n");
+            node = node->child[1];
+        }
+    }
+    if (node->bucket != NULL) {
+        return tree->bucket_scan(node->bucket, pkt);
+    }
+    // in the leaves, the id is stored in thresh
+    return node->thresh.u32;
 }
 
-static void cleanup_hs_tree(struct hs_node *node)
+/*
+ * walk a burst through the compiled tree one level at a time: every
+ * packet still on its way down issues a prefetch for its next node, so
+ * the misses of the whole burst overlap instead of queuing up. Packets
+ * ending in a bucket get the bucket index and their bit set in the
+ * returned mask, the caller scans them.
+ */
+static uint32_t hs_flat_classify_burst(const struct hs_flat_node *flat,
+        const struct packet *pkts, int n, int *res)
 {
-    if (node->child[0] == NULL && node->child[1] == NULL) {
-        return;
+    uint32_t cur[BURST_MAX], bkt = 0;
+    int act[BURST_MAX];
+    int act_num, i, j, k;
+    const struct hs_flat_node *node;
+
+    for (i = 0; i < n; i++) {
+        cur[i] = 0;
+        act[i] = i;
     }
 
-    cleanup_hs_tree(node->child[0]);
-    SAFE_FREE(node->child[0]);
+    for (act_num = n; act_num > 0; act_num = k) {
+        for (j = 0, k = 0; j < act_num; j++) {
+            i = act[j];
+            node = &flat[cur[i]];
+
+            if (node->dim >= HS_BUCKET_DIM) {
+                res[i] = node->thresh;
+                if (node->dim == HS_BUCKET_DIM) {
+                    bkt |= 1U << i;
+                }
+                continue;
+            }
 
-    cleanup_hs_tree(node->child[1]);
-    SAFE_FREE(node->child[1]);
+            cur[i] = node->child +
+                (pkts[i].val[node->dim].u32 > node->thresh);
+            __builtin_prefetch(&flat[cur[i]]);
+            act[k++] = i;
+        }
+    }
 
-    return;
+    return bkt;
 }
 
-static void printf_stats_nodes()
+/*
+ * lockstep kernels: every lane is one packet, each round gathers the
+ * current node of all lanes, does one unsigned compare and moves the
+ * lanes that have not reached a leaf yet to the left or right child.
+ * All vectors of a burst advance together so that their gathers are
+ * independent and their misses overlap.
+ */
+#define AVX2_LANES 8
+#define AVX512_LANES 16
+
+__attribute__((target("avx2")))
+static uint32_t hs_flat_classify_avx2(const struct hs_flat_node *flat,
+        const struct packet *pkts, int vec_num, int *res)
 {
-    int i;
+    const int *nodes = (const int *)flat;
+    const __m256i lane = _mm256_mullo_epi32(
+            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+            _mm256_set1_epi32(PKT_WORDS));
+    const __m256i pnt_words = _mm256_set1_epi32(PNT_WORDS);
+    const __m256i dim_mask = _mm256_set1_epi32(HS_FLAT_DIM_MASK);
+    const __m256i branch = _mm256_set1_epi32(HS_BUCKET_DIM - 1);
+    const __m256i bucket = _mm256_set1_epi32(HS_BUCKET_DIM);
+    const __m256i sign = _mm256_set1_epi32(0x80000000);
+    __m256i idx[BURST_MAX / AVX2_LANES];
+    __m256i thresh, info, dim, done, val, gt;
+    const int *vals;
+    uint32_t bkt = 0;
+    int act, v;
+
+    for (v = 0; v < vec_num; v++) {
+        idx[v] = _mm256_setzero_si256();
+    }
 
-    /* depth statistics */
-    printf("\nworst_depth = %lu", g_statistics.worst_depth);
-    printf("\naverage_depth = %f", (float)g_statistics.average_depth /
-            g_statistics.leaf_node_num);
+    for (act = (1 << vec_num) - 1; act != 0; ) {
+        for (v = 0; v < vec_num; v++) {
+            if (!(act & (1 << v))) {
+                continue;
+            }
 
-    /* node statistics */
-    printf("\ntree_node_num = %lu", g_statistics.tree_node_num);
-    printf("\nleaf_node_num = %lu", g_statistics.leaf_node_num);
-    printf("\ntotal_memory = %lu", (g_statistics.tree_node_num +
-        g_statistics.leaf_node_num) << 3);
+            thresh = _mm256_i32gather_epi32(nodes,
+                    _mm256_slli_epi32(idx[v], 1), 4);
+            info = _mm256_i32gather_epi32(nodes + 1,
+                    _mm256_slli_epi32(idx[v], 1), 4);
+            dim = _mm256_and_si256(info, dim_mask);
+            done = _mm256_cmpgt_epi32(dim, branch);
+
+            if (_mm256_movemask_epi8(done) == -1) {
+                _mm256_storeu_si256((__m256i *)&res[v * AVX2_LANES], thresh);
+                bkt |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(
+                        _mm256_cmpeq_epi32(dim, bucket))) << (v * AVX2_LANES);
+                act &= ~(1 << v);
+                continue;
+            }
 
-    /* node statistics detail */
-    printf("\ndepth   node    intrnl  leaf\n");
-    for (i = 0; i <= g_statistics.worst_depth; i++) {
-        printf("%-8d%-8lu%-8lu%-8lu\n", i, g_statistics.depth_node[i][0] +
-            g_statistics.depth_node[i][1], g_statistics.depth_node[i][0],
-            g_statistics.depth_node[i][1]);
+            /* leaves have no field to read, keep their lanes masked off */
+            vals = (const int *)&pkts[v * AVX2_LANES];
+            val = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), vals,
+                    _mm256_add_epi32(lane, _mm256_mullo_epi32(dim, pnt_words)),
+                    _mm256_andnot_si256(done, _mm256_set1_epi32(-1)), 4);
+
+            /* unsigned val > thresh, gt is -1 for the right child */
+            gt = _mm256_cmpgt_epi32(_mm256_xor_si256(val, sign),
+                    _mm256_xor_si256(thresh, sign));
+            idx[v] = _mm256_blendv_epi8(_mm256_sub_epi32(
+                        _mm256_srli_epi32(info, HS_FLAT_CHILD_SHIFT), gt),
+                    idx[v], done);
+        }
     }
-    printf("\n");
 
-    return;
+    return bkt;
 }
 
-int hs_build(const struct rule_set *rs, void *userdata)
+__attribute__((target("avx512f")))
+static uint32_t hs_flat_classify_avx512(const struct hs_flat_node *flat,
+        const struct packet *pkts, int vec_num, int *res)
 {
-    int i;
-    struct hs_node *root = calloc(1, sizeof(*root));
-
-    if (root == NULL || rs->r_rules == NULL) {
-        return -1;
+    const int *nodes = (const int *)flat;
+    const __m512i lane = _mm512_mullo_epi32(
+            _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                8, 9, 10, 11, 12, 13, 14, 15),
+            _mm512_set1_epi32(PKT_WORDS));
+    const __m512i pnt_words = _mm512_set1_epi32(PNT_WORDS);
+    const __m512i dim_mask = _mm512_set1_epi32(HS_FLAT_DIM_MASK);
+    const __m512i bucket = _mm512_set1_epi32(HS_BUCKET_DIM);
+    const __m512i one = _mm512_set1_epi32(1);
+    __m512i idx[BURST_MAX / AVX512_LANES];
+    __m512i thresh, info, dim, val;
+    __mmask16 todo, gt;
+    const int *vals;
+    uint32_t bkt = 0;
+    int act, v;
+
+    for (v = 0; v < vec_num; v++) {
+        idx[v] = _mm512_setzero_si512();
     }
 
-    g_statistics.segment_total = 1;
+    for (act = (1 << vec_num) - 1; act != 0; ) {
+        for (v = 0; v < vec_num; v++) {
+            if (!(act & (1 << v))) {
+                continue;
+            }
+
+            thresh = _mm512_i32gather_epi32(_mm512_slli_epi32(idx[v], 1),
+                    nodes, 4);
+            info = _mm512_i32gather_epi32(_mm512_slli_epi32(idx[v], 1),
+                    nodes + 1, 4);
+            dim = _mm512_and_si512(info, dim_mask);
+            todo = _mm512_cmplt_epu32_mask(dim, bucket);
+
+            if (todo == 0) {
+                _mm512_storeu_si512(&res[v * AVX512_LANES], thresh);
+                bkt |= (uint32_t)_mm512_cmpeq_epi32_mask(dim, bucket) <<
+                    (v * AVX512_LANES);
+                act &= ~(1 << v);
+                continue;
+            }
 
-    // init
-    for (i=0; i<DIM_MAX; ++i) {
-        build_estimator.choose[i]=0;
-    }
+            vals = (const int *)&pkts[v * AVX512_LANES];
+            val = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), todo,
+                    _mm512_add_epi32(lane, _mm512_mullo_epi32(dim, pnt_words)),
+                    vals, 4);
 
-    if (build_hs_tree(rs, root, 0) == 0) {
-        /* rule_set statistics */
-        printf("segment_num = ");
-        for (i = 0; i < DIM_MAX; i++) {
-            printf("%lu ", g_statistics.segment_num[i]);
+            gt = _mm512_mask_cmpgt_epu32_mask(todo, val, thresh);
+            idx[v] = _mm512_mask_mov_epi32(idx[v], todo,
+                    _mm512_srli_epi32(info, HS_FLAT_CHILD_SHIFT));
+            idx[v] = _mm512_mask_add_epi32(idx[v], gt, idx[v], one);
         }
-        printf("\n");
+    }
 
-        printf("\nsegment_total = %lu", g_statistics.segment_total);
+    return bkt;
+}
 
-        printf_stats_nodes();
+static uint32_t hs_flat_burst_scalar(const struct hs_flat_node *flat,
+        const struct packet *pkts, int n, int *res)
+{
+    return hs_flat_classify_burst(flat, pkts, n, res);
+}
 
-        *(struct hs_node **) userdata = root;
-        return 0;
-    } else {
-        *(struct hs_node **) userdata = NULL;
-        return -1;
+/* whole vectors go through the kernel, the tail through the scalar code */
+static uint32_t hs_flat_burst_avx2(const struct hs_flat_node *flat,
+        const struct packet *pkts, int n, int *res)
+{
+    int i = n / AVX2_LANES * AVX2_LANES;
+    uint32_t bkt = 0;
+
+    if (i > 0) {
+        bkt = hs_flat_classify_avx2(flat, pkts, i / AVX2_LANES, res);
+    }
+    if (i < n) {
+        bkt |= hs_flat_classify_burst(flat, &pkts[i], n - i, &res[i]) << i;
     }
+
+    return bkt;
 }
 
-int hs_insrt_rule(struct rng_rule *p_r, void *userdata)
+static uint32_t hs_flat_burst_avx512(const struct hs_flat_node *flat,
+        const struct packet *pkts, int n, int *res)
 {
-    struct hs_node *p_tnode = *(typeof(p_tnode) *)userdata;
-    struct s_node *p_sn = NULL, *p_tmp_sn = NULL;
-    struct s_head *p_sh = malloc(sizeof *p_sh);
-    int i;
+    int i = n / AVX512_LANES * AVX512_LANES;
+    uint32_t bkt = 0;
 
-    STAILQ_INIT(p_sh);
-    p_sn = calloc(1, sizeof *p_sn);
-    p_sn->r.dim[0][1].u32 = (1UL << 32) - 1;
-    p_sn->r.dim[1][1].u32 = (1UL << 32) - 1;
-    p_sn->r.dim[2][1].u16 = (1U << 16) - 1;
-    p_sn->r.dim[3][1].u16 = (1U << 16) - 1;
-    p_sn->r.dim[4][1].u8 = 255;
-    p_sn->p_tn = p_tnode;
-    STAILQ_INSERT_HEAD(p_sh, p_sn, entry);
-
-    while (!STAILQ_EMPTY(p_sh)) {
-        p_sn = STAILQ_FIRST(p_sh);
-        STAILQ_REMOVE_HEAD(p_sh, entry);
-        while (p_sn->p_tn->d2s != -1) {
-            if (is_less_equal(&p_r->dim[p_sn->p_tn->d2s][1], &p_sn->p_tn->thresh)) {
-                p_sn->r.dim[p_sn->p_tn->d2s][1] = p_sn->p_tn->thresh;
-                p_sn->p_tn = p_sn->p_tn->child[0];
-            } else if (is_less(&p_sn->p_tn->thresh, &p_r->dim[p_sn->p_tn->d2s][0])) {
-                p_sn->r.dim[p_sn->p_tn->d2s][0] = p_sn->p_tn->thresh;
-                point_inc(&p_sn->r.dim[p_sn->p_tn->d2s][0]);
-                p_sn->p_tn = p_sn->p_tn->child[1];
-            } else {
-                p_tmp_sn = malloc(sizeof *p_tmp_sn);
-                p_tmp_sn->p_tn = p_sn->p_tn->child[1];
-                p_tmp_sn->r = p_sn->r;
-                p_tmp_sn->r.dim[p_sn->p_tn->d2s][0] = p_sn->p_tn->thresh;
-                point_inc(&p_tmp_sn->r.dim[p_sn->p_tn->d2s][0]);
-                STAILQ_INSERT_HEAD(p_sh, p_tmp_sn, entry);
-                p_sn->r.dim[p_sn->p_tn->d2s][1] = p_sn->p_tn->thresh;
-                p_sn->p_tn = p_sn->p_tn->child[0];
-            }
-        }
-        if (p_r->pri >= p_sn->p_tn->thresh.u32) {
-            SAFE_FREE(p_sn);
-            continue;
-        }
-        /* in case that p_sn->r is "in" p_r */
-        for (i = 0; i < DIM_MAX; i++) {
-            if (is_greater(&p_r->dim[i][0], &p_sn->r.dim[i][0])) {
-                /* left */
-                p_tnode = calloc(1, sizeof *p_tnode);
-                p_tnode->d2s = -1;
-                p_tnode->depth = p_sn->p_tn->depth + 1;
-                p_tnode->thresh.u32 = p_sn->p_tn->thresh.u32;
-                p_sn->p_tn->child[0] = p_tnode;
-                /* right */
-                p_tnode = calloc(1, sizeof *p_tnode);
-                p_tnode->d2s = -1;
-                p_tnode->depth = p_sn->p_tn->depth + 1;
-                p_tnode->thresh.u32 = p_sn->p_tn->thresh.u32;
-                p_sn->p_tn->child[1] = p_tnode;
-                /* g_statistics */
-                g_statistics.tree_node_num++;
-                g_statistics.leaf_node_num++;
-                g_statistics.depth_node[p_sn->p_tn->depth][0]++;
-                g_statistics.depth_node[p_sn->p_tn->depth][1]--;
-                g_statistics.depth_node[p_tnode->depth][1] += 2;
-                g_statistics.average_depth += 1 + p_tnode->depth;
-                if (g_statistics.worst_depth < p_tnode->depth) {
-                    g_statistics.worst_depth = p_tnode->depth;
-                }
-                /* itself */
-                p_sn->p_tn->d2s = i;
-                p_sn->p_tn->thresh = p_r->dim[i][0];
-                point_dec(&p_sn->p_tn->thresh);
-                //printf("d2s:%d; thresh:%u; left_pri:%u\n", i, p_sn->p_tn->thresh.u32, p_tnode->thresh.u32);
-                p_sn->p_tn = p_sn->p_tn->child[1];
-                p_sn->r.dim[i][0] = p_r->dim[i][0];
-            }
-            if (is_less(&p_r->dim[i][1], &p_sn->r.dim[i][1])) {
-                /* right */
-                p_tnode = calloc(1, sizeof *p_tnode);
-                p_tnode->d2s = -1;
-                p_tnode->depth = p_sn->p_tn->depth + 1;
-                p_tnode->thresh.u32 = p_sn->p_tn->thresh.u32;
-                p_sn->p_tn->child[1] = p_tnode;
-                /* left */
-                p_tnode = calloc(1, sizeof *p_tnode);
-                p_tnode->d2s = -1;
-                p_tnode->depth = p_sn->p_tn->depth + 1;
-                p_tnode->thresh.u32 = p_sn->p_tn->thresh.u32;
-                p_sn->p_tn->child[0] = p_tnode;
-                /* g_statistics */
-                g_statistics.tree_node_num++;
-                g_statistics.leaf_node_num++;
-                g_statistics.depth_node[p_sn->p_tn->depth][0]++;
-                g_statistics.depth_node[p_sn->p_tn->depth][1]--;
-                g_statistics.depth_node[p_tnode->depth][1] += 2;
-                g_statistics.average_depth += 1 + p_tnode->depth;
-                if (g_statistics.worst_depth < p_tnode->depth) {
-                    g_statistics.worst_depth = p_tnode->depth;
-                }
-                /* itself */
-                p_sn->p_tn->d2s = i;
-                p_sn->p_tn->thresh = p_r->dim[i][1];
-                //printf("d2s:%d; thresh:%u; right_pri:%u\n", i, p_sn->p_tn->thresh.u32, p_tnode->thresh.u32);
-                p_sn->p_tn = p_sn->p_tn->child[0];
-            }
-        }
-        p_sn->p_tn->thresh.u32 = p_r->pri-1;
-        SAFE_FREE(p_sn);
+    if (i > 0) {
+        bkt = hs_flat_classify_avx512(flat, pkts, i / AVX512_LANES, res);
     }
-    SAFE_FREE(p_sh);
-    return 0;
+    if (i < n) {
+        bkt |= hs_flat_burst_avx2(flat, &pkts[i], n - i, &res[i]) << i;
+    }
+
+    return bkt;
 }
 
 
-int hs_insrt_update(const struct rule_set *rs, void *userdata)
+/*
+ * pick the widest kernel allowed by hs_conf that the cpu supports; kept
+ * in the tree so a build never swaps the kernels of a tree in use
+ */
+static void select_hs_kernel(struct hs_tree *tree)
 {
-    if (!*(void **) userdata || !rs->r_rules) return -1;
-    int i;
+    int simd = hs_conf.simd;
 
-    for (i = 0; i < rs->num; i++) {
-        if (hs_insrt_rule(&rs->r_rules[i], userdata) != 0) {
-            return -1;
-        }
+    if (simd == HS_SIMD_AUTO) {
+        simd = HS_SIMD_AVX512;
+    }
+
+    __builtin_cpu_init();
+    if (simd == HS_SIMD_AVX512 && !__builtin_cpu_supports("avx512f")) {
+        simd = HS_SIMD_AVX2;
+    }
+    if (simd == HS_SIMD_AVX2 && !__builtin_cpu_supports("avx2")) {
+        simd = HS_SIMD_NONE;
     }
 
-    printf_stats_nodes();
+    switch (simd) {
+    case HS_SIMD_AVX512:
+        tree->flat_burst = hs_flat_burst_avx512;
+        tree->wide_classify = hs_wide_classify_avx512;
+        tree->bucket_scan = hs_bucket_scan_avx2;
+        printf("\nsimd_kernel = avx512");
+        break;
+    case HS_SIMD_AVX2:
+        tree->flat_burst = hs_flat_burst_avx2;
+        tree->wide_classify = hs_wide_classify_avx2;
+        tree->bucket_scan = hs_bucket_scan_avx2;
+        printf("\nsimd_kernel = avx2");
+        break;
+    default:
+        tree->flat_burst = hs_flat_burst_scalar;
+        tree->wide_classify = hs_wide_classify_scalar;
+        tree->bucket_scan = hs_bucket_scan_scalar;
+        printf("\nsimd_kernel = none");
+        break;
+    }
+    printf("\n");
 
-    return 0;
+    return;
 }
 
-int hs_classify(const struct packet *pkt, const void *userdata)
+int hs_classify_burst(const struct packet *pkts, int n, int *res,
+        const void *userdata)
 {
-    struct hs_node *node = *(typeof(node) *)userdata;
+    const struct hs_tree *tree = *(typeof(tree) *)userdata;
+    uint32_t bkt;
+    int i, j, m;
 
-    while (node->child[0] != NULL || node->child[1] != NULL) {
-        //printf("d2s:%d; pkt->val[%d].u32:%u; node.thresh.u32:%u\n", node->d2s, node->d2s, pkt->val[node->d2s].u32, node->thresh.u32);
-        if (pkt->val[node->d2s].u32 <= node->thresh.u32) {
-            //printf("left\n");
-            node = node->child[0];
-        } else {
-            //printf("right\n");
-            node = node->child[1];
+    if (tree->flat == NULL) {
+        for (i = 0; i < n; i++) {
+            res[i] = hs_classify(&pkts[i], userdata);
+        }
+        return 0;
+    }
+
+    for (i = 0; i < n; i += BURST_MAX) {
+        m = n - i < BURST_MAX ? n - i : BURST_MAX;
+        bkt = tree->flat_burst(tree->flat, &pkts[i], m, &res[i]);
+        for (; bkt != 0; bkt &= bkt - 1) {
+            j = i + __builtin_ctz(bkt);
+            res[j] = tree->bucket_scan(tree->buckets[res[j]], &pkts[j]);
         }
     }
-    // in the leaves, the id is stored in thresh
-    return node->thresh.u32;
+
+    return 0;
 }
 
 int hs_search(const struct trace *t, const void *userdata)
 {
-    int i, c;
+    int i, m;
+    int res[BURST_MAX];
 
-    for (i = 0; i < t->num; i++) {
+    for (i = 0; i < t->num; i += BURST_MAX) {
+        m = t->num - i < BURST_MAX ? t->num - i : BURST_MAX;
         // todo: deal with the mismatch
-        hs_classify(&t->pkts[i], userdata);
-//        if ((c = hs_classify(&t->pkts[i], userdata)) != t->pkts[i].match) {
-//            fprintf(stderr, "pkt[%d] match:%d, classify:%d\n", i+1, t->pkts[i].match+1, c+1);
-//            return -1;
-//        }
+        hs_classify_burst(&t->pkts[i], m, res, userdata);
     }
 
     return 0;
 }
 
-int estimate_build_hs_tree(const struct rule_set *rs, struct hs_node *cur_node) {
+int estimate_build_hs_tree(const struct rule_set *rs,
+        struct hs_build_estimator *est) {
     int *wght, wght_all;
     float wght_avg;
-    int max_pnt, num, pnt_num, d2s, d, i, j;
+    int max_pnt, num, pnt_num, d2s, d, i;
 
     union point thresh;
     struct rule_set child_rs;
+    struct hs_region rg;
     struct seg_point *seg_pnts;
     struct range lrange, rrange;
 
+    init_hs_region(&rg, rs);
     max_pnt = d2s = 0;
     num = rs->num << 1;
 
@@ -620,7 +3655,7 @@ int estimate_build_hs_tree(const struct rule_set *rs, struct hs_node *cur_node)
     /*
      * estimating starts here
      */
-    build_estimator.segment_sum=0;
+    bzero(est, sizeof(*est));
     for (d = 0; d < DIM_MAX; d++) {
         bzero(wght, num * sizeof(*wght));
         bzero(seg_pnts, num * sizeof(*seg_pnts));
@@ -674,30 +3709,25 @@ int estimate_build_hs_tree(const struct rule_set *rs, struct hs_node *cur_node)
         if (pnt_num < 3) {
             continue; /* skip this dim: no more ranges */
         }
-        build_estimator.distribute[d]=pnt_num;
-        build_estimator.segment_sum+=pnt_num;
+        est->distribute[d]=pnt_num;
+        est->segment_sum+=pnt_num;
 
         /*
          * gen heuristic info
          */
-        for (wght_all = 0, i = 0; i < pnt_num - 1; i++) {
-            for (wght[i] = 0, j = 0; j < rs->num; j++) {
-                if (is_less_equal(&rs->r_rules[j].dim[d][0],
-                                  &seg_pnts[i].pnt) &&
-                    is_greater_equal(&rs->r_rules[j].dim[d][1],
-                                     &seg_pnts[i + 1].pnt)) {
-                    wght[i]++;
-                    wght_all++;
-                }
-            }
-        }
-        build_estimator.overlap_density[d] = (float)wght_all / (rs->num - 1);
+        wght_all = gen_seg_wght(&rg, d, seg_pnts, pnt_num, wght);
+        est->overlap_density[d] = (float)wght_all / (rs->num - 1);
     }
+
+    SAFE_FREE(wght);
+    SAFE_FREE(seg_pnts);
+    SAFE_FREE(child_rs.r_rules);
     return 0;
 }
 
 
-int estimate_update_hs_tree(const struct rule_set *rs, const struct rule_set *u_rs, struct hs_node *cur_node) {
+int estimate_update_hs_tree(const struct rule_set *rs,
+        const struct rule_set *u_rs, struct hs_update_estimator *est) {
     int *wght, wght_all;
     float wght_avg;
     int max_pnt, num, pnt_num, d2s, d, i, j;
@@ -734,6 +3764,7 @@ int estimate_update_hs_tree(const struct rule_set *rs, const struct rule_set *u_
     /*
      * estimating starts here
      */
+    bzero(est, sizeof(*est));
     for (d = 0; d < DIM_MAX; d++) {
         bzero(wght, num * sizeof(*wght));
         bzero(seg_pnts, num * sizeof(*seg_pnts));
@@ -787,7 +3818,7 @@ int estimate_update_hs_tree(const struct rule_set *rs, const struct rule_set *u_
         if (pnt_num < 3) {
             continue; /* skip this dim: no more ranges */
         }
-        update_estimator.distribute[d]=pnt_num;
+        est->distribute[d]=pnt_num;
 
         /*
          * gen heuristic info
@@ -804,49 +3835,61 @@ int estimate_update_hs_tree(const struct rule_set *rs, const struct rule_set *u_
                                      &seg_pnts[i + 1].pnt)) {
                     wght[i]++;
                     wght_all++;
-                    update_estimator.meet[d]+=1;
-                    update_estimator.meet_num+=1;
+                    est->meet[d]+=1;
+                    est->meet_num+=1;
                 }
             }
         }
-        update_estimator.overlap_density[d] = (float)wght_all / (u_rs->num - 1);
+        est->overlap_density[d] = (float)wght_all / (u_rs->num - 1);
         gettimeofday(&stoptime, NULL);
         timediff = make_timediff(&starttime, &stoptime);
         timetotal+=timediff;
     }
 
+    SAFE_FREE(wght);
+    SAFE_FREE(seg_pnts);
+    SAFE_FREE(child_rs.r_rules);
+
     printf("Estimating pass\n");
     printf("Time for estimating(us): %llu\n", timetotal);
     return 0;
 }
 
+static float hs_avg_density(const struct hs_build_estimator *est)
+{
+    float avg_density = 0;
+    int i;
+
+    for(i=0; i<DIM_MAX; ++i)
+        avg_density+=est->distribute[i]*est->overlap_density[i]
+                     /(float)est->segment_sum;
+
+    return avg_density;
+}
+
 int hs_build_estimate(const struct rule_set *rs, void *userdata) {
     int i;
     float time_base_operation = 10;
     float avg_density, estimate_build_time;
-    struct hs_node *root = calloc(1, sizeof(*root));
+    struct hs_build_estimator est;
 
-    if (root == NULL || rs->r_rules == NULL) {
+    if (rs->r_rules == NULL) {
         return -1;
     }
 
-    if (estimate_build_hs_tree(rs, root) == 0) {
+    if (estimate_build_hs_tree(rs, &est) == 0) {
         float adapted_factor = 1;
         printf("Overlap density = ");
         for (i = 0; i < DIM_MAX; i++) {
-            printf("%f ", build_estimator.overlap_density[i]);
+            printf("%f ", est.overlap_density[i]);
         }
         printf("\n");
         printf("Distribute = ");
         for (i = 0; i < DIM_MAX; i++) {
-            printf("%zu ", build_estimator.distribute[i]);
+            printf("%zu ", est.distribute[i]);
         }
         printf("\n");
-        avg_density=0;
-        for(i=0; i<DIM_MAX; ++i)
-            avg_density+=build_estimator.distribute[i]*build_estimator.overlap_density[i]
-                         /(float)build_estimator.segment_sum;
-        build_estimator.avg_density = avg_density;
+        avg_density = hs_avg_density(&est);
         printf("Average density = %f \n", avg_density);
         // adapted
         if(avg_density<10)
@@ -908,18 +3951,15 @@ int hs_update_estimate(const struct rule_set *rs, const struct rule_set *u_rs, v
     float adapted_factor = 1;
 //    int thresh_1 = 50;
 //    int thresh_2 = 140;
-    float avg_density, estimate_build_time;
-    struct hs_node *root = calloc(1, sizeof(*root));
-
+    float avg_density, build_density, estimate_build_time;
+    const struct hs_stats *st = hs_get_stats(userdata);
+    struct hs_build_estimator b_est;
+    struct hs_update_estimator est;
 
-    if (root == NULL || rs->r_rules == NULL) {
+    if (rs->r_rules == NULL || estimate_build_hs_tree(rs, &b_est) != 0) {
         return -1;
     }
-
-    // init
-    for (i=0; i<DIM_MAX; ++i) {
-        update_estimator.meet[i]=0;
-    }
+    build_density = hs_avg_density(&b_est);
 
 
 //    // method 1, does not work
@@ -929,40 +3969,41 @@ int hs_update_estimate(const struct rule_set *rs, const struct rule_set *u_rs, v
 //    printf("Estimated time:%f \n", estimate_build_time);
 
 //     method 2
-    if (estimate_update_hs_tree(rs, u_rs, root) == 0) {
+    if (estimate_update_hs_tree(rs, u_rs, &est) == 0) {
         printf("Overlap density = ");
         for (i = 0; i < DIM_MAX; i++) {
-            printf("%f ", update_estimator.overlap_density[i]);
+            printf("%f ", est.overlap_density[i]);
         }
         printf("\n");
 //        printf("Choose = ");
 //        for (i = 0; i < DIM_MAX; i++) {
-//            printf("%d ", build_estimator.choose[i]);
+//            printf("%lu ", st->choose[i]);
 //        }
 //        printf("\n");
-//        printf("Choose num = %lu\n", build_estimator.choose_num);
+//        printf("Choose num = %lu\n", st->choose_num);
 
         printf("Meet = ");
         for (i = 0; i < DIM_MAX; i++) {
-            printf("%d ", update_estimator.meet[i]);
+            printf("%d ", est.meet[i]);
         }
         printf("\n");
-        printf("Meet num = %lu\n", update_estimator.meet_num);
+        printf("Meet num = %lu\n", est.meet_num);
 
 
-        printf("Average seg depth = %f\n", build_estimator.avg_choose_depth / (double)build_estimator.choose_num);
+        printf("Average seg depth = %f\n", st != NULL && st->choose_num ?
+                st->choose_depth / (double)st->choose_num : 0.);
 
 //        avg_density=0;
 //        for(i=0; i<DIM_MAX; ++i)
-//            avg_density+=build_estimator.choose[i]*update_estimator.overlap_density[i]
-//                         /(float)build_estimator.choose_num;
+//            avg_density+=st->choose[i]*est.overlap_density[i]
+//                         /(float)st->choose_num;
 //
 //        printf("Average density(by choose) = %f\n", avg_density);
 
         avg_density=0;
         for(i=0; i<DIM_MAX; ++i)
-            avg_density+=update_estimator.meet[i]*update_estimator.overlap_density[i]
-                         /(float)update_estimator.meet_num;
+            avg_density+=est.meet[i]*est.overlap_density[i]
+                         /(float)est.meet_num;
         printf("Average density(by meet) = %f\n", avg_density);
 
         printf("Updating rule num = %d\n", u_rs->num);
@@ -970,13 +4011,13 @@ int hs_update_estimate(const struct rule_set *rs, const struct rule_set *u_rs, v
         printf("Base operation = %f \n", time_base_operation);
 
         // adapting...
-        if(build_estimator.avg_density<20)
+        if(build_density<20)
             adapted_factor = 1;
-        if(build_estimator.avg_density>30)// && build_estimator.avg_density<50)
+        if(build_density>30)// && build_density<50)
             adapted_factor = 6;
-        if(build_estimator.avg_density>90)// && build_estimator.avg_density<100)
+        if(build_density>90)// && build_density<100)
             adapted_factor = 7;
-        if(build_estimator.avg_density>200)// && build_estimator.avg_density<300)
+        if(build_density>200)// && build_density<300)
             adapted_factor = 10;
 
 
@@ -994,9 +4035,48 @@ int hs_update_estimate(const struct rule_set *rs, const struct rule_set *u_rs, v
 
 void hs_cleanup(void *userdata)
 {
-    struct hs_node *rt = *(typeof(rt) *)userdata;
-    cleanup_hs_tree(rt);
-    SAFE_FREE(rt);
+    struct hs_tree *tree = *(typeof(tree) *)userdata;
+
+    if (tree == NULL) {
+        return;
+    }
+
+    free_hs_arena(&tree->arena);
+    free_hs_stats(&tree->stats);
+    SAFE_FREE(tree->rules);
+    SAFE_FREE(tree->buckets);
+    SAFE_FREE(tree->flat);
+    SAFE_FREE(tree->wide);
+    SAFE_FREE(tree);
+    *(struct hs_tree **)userdata = NULL;
 
     return;
 }
+
+const struct hs_stats *hs_get_stats(const void *userdata)
+{
+    const struct hs_tree *tree = *(typeof(tree) *)userdata;
+
+    return tree != NULL ? &tree->stats : NULL;
+}
+
+size_t hs_depth_num(const struct hs_stats *st, size_t depth, int leaf)
+{
+    return depth < st->depth_cap ? st->depth_node[leaf][depth] : 0;
+}
+
+/* bytes the tree holds: its arena plus the compiled layout */
+size_t hs_memory(const void *userdata)
+{
+    const struct hs_tree *tree = *(typeof(tree) *)userdata;
+
+    if (tree == NULL) {
+        return 0;
+    }
+
+    return hs_arena_size(&tree->arena) +
+        tree->flat_num * sizeof(*tree->flat) +
+        tree->wide_num * 2 * tree->wide_fanout * sizeof(*tree->wide) +
+        tree->bucket_cap * sizeof(*tree->buckets) +
+        tree->rule_cap * sizeof(*tree->rules);
+}
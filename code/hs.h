@@ -18,22 +18,195 @@
 
 #include "pc_eval.h"
 
+/*
+ * leaf bucket: the rules left in a leaf region, highest priority first,
+ * kept as one array per field bound so that a vector compares the same
+ * field of HS_BUCKET_LANES rules at once. Unused slots never match.
+ */
+#define HS_BUCKET_LANES 8
+
+struct hs_bucket {
+    int num;
+    int cap;            /* multiple of HS_BUCKET_LANES */
+    int *pri;
+    uint32_t *lo[DIM_MAX];
+    uint32_t *hi[DIM_MAX];
+    struct hs_bucket *next;     /* in a free list of the arena */
+};
+
 /*
  * k-d tree
  */
 struct hs_node {
     int d2s;
-    uint8_t depth;
+    uint32_t depth;
+    uint32_t height;    /* of the subtree, what the updates made of it */
+    uint32_t ref;       /* parents sharing this subtree */
+    uint32_t size;      /* nodes of the subtree */
+    uint32_t base_height;   /* height and size the subtree was built with, */
+    uint32_t base_size;     /* the updates since are measured against them */
     union point thresh;
     struct hs_node *child[2];
+    struct hs_bucket *bucket;   /* leaves holding more than one rule */
 };
 
+/*
+ * compiled k-d tree: one contiguous array of 8-byte nodes in breadth-first
+ * order. Both children of a node are stored next to each other, so only
+ * the index of the left child is kept, the right child follows it.
+ */
+#define HS_BUCKET_DIM 6
+#define HS_LEAF_DIM 7
+
+struct hs_flat_node {
+    uint32_t thresh;        /* split value; priority or bucket in leaves */
+    uint32_t dim :3;        /* dimension to split; HS_LEAF_DIM in leaves,
+                               HS_BUCKET_DIM in bucket leaves */
+    uint32_t child :29;     /* index of the left child */
+};
+
+/* the SIMD kernels gather the second word as (child << 3) | dim */
+#define HS_FLAT_DIM_MASK 0x7
+#define HS_FLAT_CHILD_SHIFT 3
+
+/*
+ * multi-way compiled k-d tree: up to HS_WIDE_LEVELS binary levels split
+ * on the same dimension are collapsed into one node of fanout 2^levels.
+ * A node is 2 * fanout words: the sorted thresholds (unused ones are
+ * UINT32_MAX), the dimension, then one reference per child which is
+ * either the index of a wide node, HS_WIDE_LEAF | priority or
+ * HS_WIDE_LEAF | HS_WIDE_BUCKET | bucket.
+ */
+#define HS_WIDE_LEVELS 4
+#define HS_WIDE_FANOUT (1 << HS_WIDE_LEVELS)
+#define HS_WIDE_LEAF 0x80000000U
+#define HS_WIDE_BUCKET 0x40000000U
+
+/*
+ * nodes and buckets of a tree are carved out of big chunks, all of them
+ * released together with the tree. The ones of rebuilt subtrees are kept
+ * in free lists and handed out again first, buckets by the power of two
+ * of their lanes.
+ */
+struct hs_chunk;
+
+#define HS_FREE_BUCKETS 16
+
+struct hs_arena {
+    struct hs_chunk *chunk;     /* the one allocated from, older ones follow */
+    struct hs_node *free_node;  /* linked by child[0] */
+    struct hs_bucket *free_bucket[HS_FREE_BUCKETS];
+};
+
+/*
+ * statistics of one tree: what the build made, kept up to date by the
+ * updates since, which also count what they added. Depths are counted
+ * in binary nodes whatever the layout.
+ */
+struct hs_stats {
+    size_t segment_num[DIM_MAX];    /* of the whole rule set */
+    size_t segment_total;
+
+    size_t worst_depth;
+    size_t average_depth;   /* sum of the leaf depths */
+    size_t tree_node_num;
+    size_t leaf_node_num;
+    size_t *depth_node[2];  /* inner nodes and leaves at each depth */
+    size_t depth_cap;
+
+    size_t shared_num;
+
+    size_t bucket_num;
+    size_t bucket_rules;
+    size_t bucket_forced;   /* buckets over binth made by the budget */
+    size_t bucket_memory;
+
+    size_t choose[DIM_MAX]; /* inner nodes cut on each dimension */
+    size_t choose_num;
+    size_t choose_depth;    /* sum of their depths */
+
+    size_t update_rules;
+    size_t delete_rules;
+    size_t update_nodes;
+    size_t update_memory;   /* bytes the updates took from the arena */
+    size_t rebuild_num;     /* subtrees the updates degraded, built again */
+    size_t rebuild_rules;   /* the rules they covered */
+};
+
+/* a rule the tree holds, the next best of a leaf is looked up among them */
+struct hs_rule {
+    uint32_t lo[DIM_MAX];
+    uint32_t hi[DIM_MAX];
+    int pri;
+};
+
+struct hs_tree {
+    struct hs_stats stats;
+    struct hs_arena arena;
+    struct hs_node *root;
+    struct hs_flat_node *flat;
+    size_t flat_num;
+    uint32_t *wide;
+    size_t wide_num;
+    int wide_fanout;
+    struct hs_bucket **buckets; /* indexed by the compiled bucket leaves */
+    size_t bucket_num;
+    size_t bucket_cap;
+    struct hs_rule *rules;      /* in priority order */
+    size_t rule_num;
+    size_t rule_cap;
+    /* lookup kernels picked for this tree from hs_conf.simd */
+    uint32_t (*flat_burst)(const struct hs_flat_node *,
+            const struct packet *, int, int *);
+    int (*wide_classify)(const uint32_t *, int, const struct packet *);
+    int (*bucket_scan)(const struct hs_bucket *, const struct packet *);
+};
+
+enum {
+    HS_LAYOUT_PTR = 0,
+    HS_LAYOUT_FLAT = 1,
+    HS_LAYOUT_WIDE = 2,
+    HS_LAYOUT_NUM = 3
+};
+
+enum {
+    HS_SIMD_NONE = 0,
+    HS_SIMD_AVX2 = 1,
+    HS_SIMD_AVX512 = 2,
+    HS_SIMD_AUTO = 3,
+    HS_SIMD_NUM = 4
+};
+
+struct hs_conf {
+    int layout;
+    int simd;           /* widest lockstep kernel allowed for burst lookups */
+    int wide_levels;    /* binary levels per wide node, 2 to HS_WIDE_LEVELS */
+    int dag;            /* share subtrees built from identical rule sets */
+    int binth;          /* rules a leaf bucket may hold, 1 for no buckets */
+    int max_depth;      /* deeper regions become buckets, 0 for no limit */
+    size_t max_mem;     /* tree bytes before the rest becomes buckets, 0 for no limit */
+    int threads;        /* workers building the tree, 1 to build serially */
+    float rebuild_depth;    /* updated subtrees deeper than this times their
+                               built height, at least log2 of their rules,
+                               are rebuilt, 0 for never */
+    float rebuild_nodes;    /* same for nodes, at least one per rule */
+};
+
+extern struct hs_conf hs_conf;
+
 int hs_build(const struct rule_set *rs, void *userdata);
 int hs_insrt_update(const struct rule_set *rs, void *userdata);
+int hs_delete_update(const struct rule_set *rs, void *userdata);
 int hs_classify(const struct packet *pkt, const void *userdata);
+int hs_classify_burst(const struct packet *pkts, int n, int *res, const void *userdata);
 int hs_search(const struct trace *t, const void *userdata);
 void hs_cleanup(void *userdata);
 int hs_build_estimate(const struct rule_set *rs, void *userdata);
 int hs_update_estimate(const struct rule_set *rs, const struct rule_set *u_rs, void *userdata);
 
+/* statistics queries on a built tree */
+const struct hs_stats *hs_get_stats(const void *userdata);
+size_t hs_depth_num(const struct hs_stats *st, size_t depth, int leaf);
+size_t hs_memory(const void *userdata);
+
 #endif /* __HS_H__ */
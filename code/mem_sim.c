@@ -19,18 +19,25 @@
 #include <unistd.h>
 #include <assert.h>
 #include "pc_eval.h"
+#include "hs.h"
+#include "delta.h"
+#include "tss.h"
 
 static struct {
     char *rule_file;
     char *u_rule_file;
+    char *d_rule_file;
     char *trace_file;
     int algrthm_id;
     int estimate;
     int system;
+    int prune;
 } cfg = {
     NULL,
     NULL,
     NULL,
+    NULL,
+    0,
     0,
     0,
     0
@@ -45,9 +52,26 @@ static void print_help(void)
         "  -r, --rule FILE    specify a rule file for building\n"
         "  -t, --trace FILE   specify a trace file for searching\n"
         "  -u, --update FILE  specify a update rule file for searching\n"
-        "  -a, --algorithm ID specify an algorithm, 0:HyperSplit, 1:TSS\n"
+        "  -x, --delete FILE  specify a rule file to delete after updating\n"
+        "  -a, --algorithm ID specify an algorithm, 0:HyperSplit, 1:TSS, 2:HyperSplit with a TSS delta for updates\n"
         "  -e  --estimate     specify mode of the estimator, 0:Sleep, 1:Enable\n"
         "  -s  --system       specify mode of the system, 0:build verifier, 1:build estimator, 2:update verifier, 3:update estimator\n"
+        "  -p  --prune MODE   specify pruning of the rules before building, 0:disable (default), 1:drop shadowed and merge same-priority rules\n"
+        "  -l  --layout ID    specify the HyperSplit lookup layout, 0:pointer tree, 1:flat array (default), 2:multi-way\n"
+        "  -k  --levels NUM   specify binary levels collapsed per multi-way HyperSplit node, 2 to 4 (default)\n"
+        "  -g  --dag MODE     specify HyperSplit subtree sharing, 0:disable, 1:enable (default)\n"
+        "  -b  --binth NUM    specify rules a HyperSplit leaf bucket may hold, 1 (default) disables buckets\n"
+        "  -d  --depth NUM    specify HyperSplit depth below which leaves become buckets, 0 (default) for no limit\n"
+        "  -m  --memory KB    specify HyperSplit tree memory after which leaves become buckets, 0 (default) for no limit\n"
+        "  -j  --threads NUM  specify threads building the HyperSplit tree, 1 (default) builds serially\n"
+        "  -c  --rebuild-depth RATIO  specify HyperSplit subtrees rebuilt once updates make them RATIO times as deep as they were built, 0 (default) for never\n"
+        "  -n  --rebuild-nodes RATIO  specify HyperSplit subtrees rebuilt once updates make them RATIO times as big as they were built, 0 (default) for never\n"
+        "  -w  --delta-rules NUM   specify rules the TSS delta holds before it is merged into a new HyperSplit, 0 for never, 4096 (default)\n"
+        "  -q  --delta-tuples NUM  specify tuples the TSS delta may have before it is merged into a new HyperSplit, 0 for never, 64 (default)\n"
+        "  -y  --tss-table ID  specify the TSS hash table, 0:uthash, 1:open addressing (default)\n"
+        "  -o  --tuple-merge NUM  specify TupleMerge for TSS, NUM colliding rules a bucket may hold, 0 (default) for exact tuples\n"
+        "  -i  --bloom BITS   specify bits per key of the Bloom filter checked before a TSS tuple is probed, 0 (default) for none\n"
+        "  -v  --simd ID      specify the widest HyperSplit burst kernel, 0:scalar, 1:AVX2, 2:AVX-512, 3:auto (default)\n"
         "\n";
 
     printf("%s", help);
@@ -59,15 +83,32 @@ static void parse_args(int argc, char *argv[])
     int option;
 
 
-    static const char *optstr = "hr:t:u:a:e:s:";
+    static const char *optstr = "hr:t:u:x:a:e:s:p:l:v:k:g:b:d:m:j:c:n:w:q:y:o:i:";
     static struct option longopts[] = {
         {"help", no_argument, NULL, 'h'},
         {"rule", required_argument, NULL, 'r'},
         {"trace", required_argument, NULL, 't'},
         {"update", required_argument, NULL, 'u'},
+        {"delete", required_argument, NULL, 'x'},
         {"algorithm", required_argument, NULL, 'a'},
         {"estimate", required_argument, NULL, 'e'},
         {"system", required_argument, NULL, 's'},
+        {"prune", required_argument, NULL, 'p'},
+        {"layout", required_argument, NULL, 'l'},
+        {"simd", required_argument, NULL, 'v'},
+        {"levels", required_argument, NULL, 'k'},
+        {"dag", required_argument, NULL, 'g'},
+        {"binth", required_argument, NULL, 'b'},
+        {"depth", required_argument, NULL, 'd'},
+        {"memory", required_argument, NULL, 'm'},
+        {"threads", required_argument, NULL, 'j'},
+        {"rebuild-depth", required_argument, NULL, 'c'},
+        {"rebuild-nodes", required_argument, NULL, 'n'},
+        {"delta-rules", required_argument, NULL, 'w'},
+        {"delta-tuples", required_argument, NULL, 'q'},
+        {"tss-table", required_argument, NULL, 'y'},
+        {"tuple-merge", required_argument, NULL, 'o'},
+        {"bloom", required_argument, NULL, 'i'},
         {NULL, 0, NULL, 0}
     };
 
@@ -85,6 +126,7 @@ static void parse_args(int argc, char *argv[])
         case 'r':
         case 't':
         case 'u':
+        case 'x':
             if (access(optarg, F_OK) == -1) {
                 perror(optarg);
                 exit(-1);
@@ -95,6 +137,8 @@ static void parse_args(int argc, char *argv[])
                     cfg.trace_file = optarg;
                 } else if (option == 'u') {
                     cfg.u_rule_file = optarg;
+                } else if (option == 'x') {
+                    cfg.d_rule_file = optarg;
                 }
                 break;
             }
@@ -108,6 +152,85 @@ static void parse_args(int argc, char *argv[])
             assert(cfg.system >= VERIFY_BUILD && cfg.system < SYSTEM_MODE_NUM);
             break;
 
+        case 'p':
+            cfg.prune = atoi(optarg);
+            assert(cfg.prune == 0 || cfg.prune == 1);
+            break;
+
+        case 'l':
+            hs_conf.layout = atoi(optarg);
+            assert(hs_conf.layout >= HS_LAYOUT_PTR && hs_conf.layout < HS_LAYOUT_NUM);
+            break;
+
+        case 'v':
+            hs_conf.simd = atoi(optarg);
+            assert(hs_conf.simd >= HS_SIMD_NONE && hs_conf.simd < HS_SIMD_NUM);
+            break;
+
+        case 'k':
+            hs_conf.wide_levels = atoi(optarg);
+            assert(hs_conf.wide_levels >= 2 && hs_conf.wide_levels <= HS_WIDE_LEVELS);
+            break;
+
+        case 'g':
+            hs_conf.dag = atoi(optarg);
+            assert(hs_conf.dag == 0 || hs_conf.dag == 1);
+            break;
+
+        case 'b':
+            hs_conf.binth = atoi(optarg);
+            assert(hs_conf.binth >= 1);
+            break;
+
+        case 'd':
+            hs_conf.max_depth = atoi(optarg);
+            assert(hs_conf.max_depth >= 0);
+            break;
+
+        case 'm':
+            hs_conf.max_mem = strtoul(optarg, NULL, 0) << 10;
+            break;
+
+        case 'j':
+            hs_conf.threads = atoi(optarg);
+            assert(hs_conf.threads >= 1);
+            break;
+
+        case 'c':
+            hs_conf.rebuild_depth = atof(optarg);
+            assert(hs_conf.rebuild_depth == 0 || hs_conf.rebuild_depth >= 1);
+            break;
+
+        case 'n':
+            hs_conf.rebuild_nodes = atof(optarg);
+            assert(hs_conf.rebuild_nodes == 0 || hs_conf.rebuild_nodes >= 1);
+            break;
+
+        case 'w':
+            delta_conf.max_rules = atoi(optarg);
+            assert(delta_conf.max_rules >= 0);
+            break;
+
+        case 'q':
+            delta_conf.max_tuples = atoi(optarg);
+            assert(delta_conf.max_tuples >= 0);
+            break;
+
+        case 'y':
+            tss_conf.table = atoi(optarg);
+            assert(tss_conf.table >= TSS_TABLE_UTHASH && tss_conf.table < TSS_TABLE_NUM);
+            break;
+
+        case 'o':
+            tss_conf.merge = atoi(optarg);
+            assert(tss_conf.merge >= 0);
+            break;
+
+        case 'i':
+            tss_conf.bloom = atoi(optarg);
+            assert(tss_conf.bloom >= 0);
+            break;
+
         default:
             print_help();
             exit(-1);
@@ -123,6 +246,7 @@ int main(int argc, char *argv[])
     struct timeval starttime, stoptime;
     struct rule_set rule_set = {NULL, NULL, 0};
     struct rule_set u_rule_set = {NULL, NULL, 0};
+    struct rule_set d_rule_set = {NULL, NULL, 0};
     struct trace t;
     void *root = NULL, *root_for_estimating = NULL;
 
@@ -163,6 +287,9 @@ int main(int argc, char *argv[])
     printf("\n");
     printf("Loading rule\n");
     algrthms[cfg.algrthm_id].load_rules(&rule_set, cfg.rule_file);
+    if (cfg.prune) {
+        prune_rules(&rule_set);
+    }
 
     /*
      * Estimating before building
@@ -245,11 +372,42 @@ int main(int argc, char *argv[])
 
             printf("Updating pass\n");
             printf("Time for updating(us): %llu\n", timediff);
+            printf("Updating speed(rules/s): %lld\n", timediff ?
+                    (u_rule_set.num * 1000000ULL) / timediff : 0);
 
             unload_rules(&u_rule_set);
         }
     }
 
+    if (cfg.system == VERIFY_UPDATE && cfg.d_rule_file != NULL) {
+        if (algrthms[cfg.algrthm_id].delete_update == NULL) {
+            fprintf(stderr, "Deleting is not supported by this algorithm\n");
+            algrthms[cfg.algrthm_id].cleanup(&root);
+            exit(-1);
+        }
+
+        algrthms[cfg.algrthm_id].load_rules(&d_rule_set, cfg.d_rule_file);
+
+        printf("\n");
+        printf("Deleting\n");
+        gettimeofday(&starttime, NULL);
+
+        if (algrthms[cfg.algrthm_id].delete_update(&d_rule_set, &root) != 0) {
+            fprintf(stderr, "Deleting failed\n");
+            unload_rules(&d_rule_set);
+            exit(-1);
+        }
+        gettimeofday(&stoptime, NULL);
+        timediff = make_timediff(&starttime, &stoptime);
+
+        printf("Deleting pass\n");
+        printf("Time for deleting(us): %llu\n", timediff);
+        printf("Deleting speed(rules/s): %lld\n", timediff ?
+                (d_rule_set.num * 1000000ULL) / timediff : 0);
+
+        unload_rules(&d_rule_set);
+    }
+
     /*
      * Searching
      */
@@ -276,6 +434,9 @@ int main(int argc, char *argv[])
     printf("Searching pass\n");
     printf("Time for searching(us): %llu\n", timediff);
     printf("Searching speed(pps): %lld\n", (t.num * 1000000ULL) / timediff);
+    if (cfg.algrthm_id == ALGO_TSS) {
+        tss_search_stats(&t, &root);
+    }
 
     unload_trace(&t);
     algrthms[cfg.algrthm_id].cleanup(&root);
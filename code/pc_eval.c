@@ -29,6 +29,8 @@
 #include "pc_eval.h"
 #include "hs.h"
 #include "tss.h"
+#include "delta.h"
+#include "uthash.h"
 
 #define swap(a, b) \
     do { typeof(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
@@ -38,7 +40,9 @@ struct algo_t algrthms[ALGO_NUM] = {
         load_cb_rules,
         hs_build,
         hs_insrt_update,
+        hs_delete_update,
         hs_classify,
+        hs_classify_burst,
         hs_search,
         hs_cleanup,
         hs_build_estimate,
@@ -48,11 +52,25 @@ struct algo_t algrthms[ALGO_NUM] = {
         load_prfx_rules,
         tss_build,
         tss_build,
+        tss_delete_update,
         tss_classify,
+        tss_classify_burst,
         tss_search,
         tss_cleanup,
         tss_build_estimate,
         tss_update_estimate
+    },
+    {
+        load_cb_rules,
+        delta_build,
+        delta_insrt_update,
+        NULL,
+        delta_classify,
+        delta_classify_burst,
+        delta_search,
+        delta_cleanup,
+        delta_build_estimate,
+        delta_update_estimate
     }
 };
 
@@ -255,6 +273,357 @@ void unload_rules(struct rule_set *rs)
     return;
 }
 
+/*
+ * rule pruning
+ */
+static const int prune_bits[DIM_MAX] = {32, 32, 16, 16, 8};
+
+/* a rule of either format as ranges */
+struct prune_rule {
+    uint32_t lo[DIM_MAX];
+    uint32_t hi[DIM_MAX];
+    int pri;
+    int idx;
+    int drop;
+};
+
+/*
+ * the kept rules by the smallest aligned blocks holding their src and dst
+ * ip ranges. The block of a rule covering another is the same as or an
+ * ancestor of the other's, so a rule only checks the rules under the
+ * blocks above it on each ip, of the lengths in use.
+ */
+struct prune_dip {
+    uint64_t key;
+    int *rules;
+    int num, cap;
+    UT_hash_handle hh;
+};
+
+struct prune_sip {
+    uint64_t key;
+    uint64_t lens;      /* dst ip block lengths present */
+    struct prune_dip *dips;
+    UT_hash_handle hh;
+};
+
+struct prune_tbl {
+    uint64_t lens;      /* src ip block lengths present */
+    struct prune_sip *sips;
+};
+
+static int prune_merge_dim; /* the dim prune_merge_cmp sorts by last */
+
+static int prune_pri_cmp(const void *a, const void *b)
+{
+    const struct prune_rule *ra = a, *rb = b;
+
+    if (ra->pri != rb->pri) {
+        return ra->pri < rb->pri ? -1 : 1;
+    }
+
+    return ra->idx - rb->idx;
+}
+
+static int prune_idx_cmp(const void *a, const void *b)
+{
+    return ((const struct prune_rule *)a)->idx -
+        ((const struct prune_rule *)b)->idx;
+}
+
+/* dropped rules last, the others by all dims but one, then by that one */
+static int prune_merge_cmp(const void *a, const void *b)
+{
+    const struct prune_rule *ra = a, *rb = b;
+    int i, d;
+
+    if (ra->drop != rb->drop) {
+        return ra->drop - rb->drop;
+    }
+
+    for (i = 1; i <= DIM_MAX; i++) {
+        d = (prune_merge_dim + i) % DIM_MAX;
+        if (ra->lo[d] != rb->lo[d]) {
+            return ra->lo[d] < rb->lo[d] ? -1 : 1;
+        }
+        if (ra->hi[d] != rb->hi[d]) {
+            return ra->hi[d] < rb->hi[d] ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+static int prune_covers(const struct prune_rule *a, const struct prune_rule *b)
+{
+    int d;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (a->lo[d] > b->lo[d] || a->hi[d] < b->hi[d]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* the prefix length of [lo, hi] on @bits, -1 if it is not a prefix */
+static int prune_prefix_len(uint32_t lo, uint32_t hi, int bits)
+{
+    uint64_t size = (uint64_t)hi - lo + 1;
+    int len = bits;
+
+    if ((size & (size - 1)) != 0 || (lo & (size - 1)) != 0) {
+        return -1;
+    }
+
+    for (; size > 1; size >>= 1) {
+        len--;
+    }
+
+    return len;
+}
+
+/* the key of the block of @len bits holding @lo */
+static uint64_t prune_block(uint32_t lo, int len)
+{
+    uint32_t mask = len == 0 ? 0 : ~0U << (32 - len);
+
+    return (uint64_t)(lo & mask) << 6 | len;
+}
+
+static int prune_block_len(uint32_t lo, uint32_t hi)
+{
+    return lo == hi ? 32 : __builtin_clz(lo ^ hi);
+}
+
+/*
+ * merge the @num rules of one priority which differ on one dim only, where
+ * their ranges touch. Prefix rules only merge into prefixes.
+ */
+static int merge_prune_group(struct prune_rule *g, int num, int prfx)
+{
+    int merged = 0, changed, d, i, j, e;
+
+    do {
+        changed = 0;
+        for (d = 0; d < DIM_MAX; d++) {
+            prune_merge_dim = d;
+            qsort(g, num, sizeof(*g), prune_merge_cmp);
+
+            for (i = 0; i < num && !g[i].drop; i = j) {
+                for (j = i + 1; j < num && !g[j].drop; j++) {
+                    for (e = 0; e < DIM_MAX; e++) {
+                        if (e != d && (g[i].lo[e] != g[j].lo[e] ||
+                                    g[i].hi[e] != g[j].hi[e])) {
+                            break;
+                        }
+                    }
+                    if (e != DIM_MAX ||
+                            (uint64_t)g[i].hi[d] + 1 < g[j].lo[d]) {
+                        break;
+                    }
+                    if (g[j].hi[d] > g[i].hi[d]) {
+                        if (prfx && prune_prefix_len(g[i].lo[d], g[j].hi[d],
+                                    prune_bits[d]) < 0) {
+                            break;
+                        }
+                        g[i].hi[d] = g[j].hi[d];
+                    }
+                    if (g[j].idx < g[i].idx) {
+                        g[i].idx = g[j].idx;
+                    }
+                    g[j].drop = 1;
+                    merged++, changed = 1;
+                }
+            }
+        }
+    } while (changed);
+
+    return merged;
+}
+
+/* whether a kept rule covers @r, else keep @r */
+static int shadow_prune_rule(struct prune_tbl *tbl,
+        struct prune_rule *rules, int r)
+{
+    struct prune_rule *cur = &rules[r];
+    struct prune_sip *sip;
+    struct prune_dip *dip;
+    uint64_t key;
+    int slen, dlen, *grown, i, j, k;
+
+    slen = prune_block_len(cur->lo[DIM_SIP], cur->hi[DIM_SIP]);
+    dlen = prune_block_len(cur->lo[DIM_DIP], cur->hi[DIM_DIP]);
+
+    for (i = slen; i >= 0; i--) {
+        if (!(tbl->lens & 1ULL << i)) {
+            continue;
+        }
+        key = prune_block(cur->lo[DIM_SIP], i);
+        HASH_FIND(hh, tbl->sips, &key, sizeof(key), sip);
+        if (sip == NULL) {
+            continue;
+        }
+
+        for (j = dlen; j >= 0; j--) {
+            if (!(sip->lens & 1ULL << j)) {
+                continue;
+            }
+            key = prune_block(cur->lo[DIM_DIP], j);
+            HASH_FIND(hh, sip->dips, &key, sizeof(key), dip);
+            if (dip == NULL) {
+                continue;
+            }
+
+            for (k = 0; k < dip->num; k++) {
+                if (prune_covers(&rules[dip->rules[k]], cur)) {
+                    return 1;
+                }
+            }
+        }
+    }
+
+    key = prune_block(cur->lo[DIM_SIP], slen);
+    HASH_FIND(hh, tbl->sips, &key, sizeof(key), sip);
+    if (sip == NULL) {
+        if ((sip = calloc(1, sizeof(*sip))) == NULL) {
+            perror("Cannot allocate memory for pruning");
+            exit(-1);
+        }
+        sip->key = key;
+        HASH_ADD(hh, tbl->sips, key, sizeof(sip->key), sip);
+        tbl->lens |= 1ULL << slen;
+    }
+
+    key = prune_block(cur->lo[DIM_DIP], dlen);
+    HASH_FIND(hh, sip->dips, &key, sizeof(key), dip);
+    if (dip == NULL) {
+        if ((dip = calloc(1, sizeof(*dip))) == NULL) {
+            perror("Cannot allocate memory for pruning");
+            exit(-1);
+        }
+        dip->key = key;
+        HASH_ADD(hh, sip->dips, key, sizeof(dip->key), dip);
+        sip->lens |= 1ULL << dlen;
+    }
+
+    if (dip->num == dip->cap) {
+        dip->cap = dip->cap == 0 ? 4 : dip->cap << 1;
+        if ((grown = realloc(dip->rules,
+                        dip->cap * sizeof(*grown))) == NULL) {
+            perror("Cannot allocate memory for pruning");
+            exit(-1);
+        }
+        dip->rules = grown;
+    }
+    dip->rules[dip->num++] = r;
+
+    return 0;
+}
+
+/*
+ * drop the rules a single rule of higher or equal priority covers, and
+ * merge rules of one priority into fewer. Either way no packet changes
+ * the priority it matches. Rules keep their order and priorities; returns
+ * the number dropped.
+ */
+int prune_rules(struct rule_set *rs)
+{
+    struct prune_rule *rules;
+    struct prune_tbl tbl = {0, NULL};
+    struct prune_sip *sip, *tmp_sip;
+    struct prune_dip *dip, *tmp_dip;
+    uint32_t mask, wild;
+    int merged = 0, shadowed = 0, num, d, i, j;
+
+    if (rs->num == 0) {
+        return 0;
+    }
+
+    if ((rules = calloc(rs->num, sizeof(*rules))) == NULL) {
+        perror("Cannot allocate memory for pruning");
+        exit(-1);
+    }
+
+    for (i = 0; i < rs->num; i++) {
+        for (d = 0; d < DIM_MAX; d++) {
+            mask = prune_bits[d] == 32 ? ~0U : (1U << prune_bits[d]) - 1;
+            if (rs->r_rules != NULL) {
+                rules[i].lo[d] = rs->r_rules[i].dim[d][0].u32 & mask;
+                rules[i].hi[d] = rs->r_rules[i].dim[d][1].u32 & mask;
+            } else {
+                wild = rs->p_rules[i].len[d] >= prune_bits[d] ?
+                    0 : mask >> rs->p_rules[i].len[d];
+                rules[i].lo[d] = rs->p_rules[i].dim[d].u32 & mask & ~wild;
+                rules[i].hi[d] = rules[i].lo[d] | wild;
+            }
+        }
+        rules[i].pri = rs->r_rules != NULL ?
+            rs->r_rules[i].pri : rs->p_rules[i].pri;
+        rules[i].idx = i;
+    }
+
+    qsort(rules, rs->num, sizeof(*rules), prune_pri_cmp);
+
+    for (i = 0; i < rs->num; i = j) {
+        for (j = i + 1; j < rs->num && rules[j].pri == rules[i].pri; j++);
+        if (j - i > 1) {
+            merged += merge_prune_group(&rules[i], j - i, rs->p_rules != NULL);
+        }
+    }
+
+    for (i = 0; i < rs->num; i++) {
+        if (!rules[i].drop && shadow_prune_rule(&tbl, rules, i)) {
+            rules[i].drop = 1;
+            shadowed++;
+        }
+    }
+
+    HASH_ITER(hh, tbl.sips, sip, tmp_sip) {
+        HASH_ITER(hh, sip->dips, dip, tmp_dip) {
+            HASH_DEL(sip->dips, dip);
+            SAFE_FREE(dip->rules);
+            free(dip);
+        }
+        HASH_DEL(tbl.sips, sip);
+        free(sip);
+    }
+
+    /* write back the kept rules in their order */
+    qsort(rules, rs->num, sizeof(*rules), prune_idx_cmp);
+    for (i = 0, num = 0; i < rs->num; i++) {
+        if (rules[i].drop) {
+            continue;
+        }
+
+        for (d = 0; d < DIM_MAX; d++) {
+            if (rs->r_rules != NULL) {
+                bzero(rs->r_rules[num].dim[d], sizeof(rs->r_rules[num].dim[d]));
+                rs->r_rules[num].dim[d][0].u32 = rules[i].lo[d];
+                rs->r_rules[num].dim[d][1].u32 = rules[i].hi[d];
+            } else {
+                bzero(&rs->p_rules[num].dim[d], sizeof(rs->p_rules[num].dim[d]));
+                rs->p_rules[num].dim[d].u32 = rules[i].lo[d];
+                rs->p_rules[num].len[d] = prune_prefix_len(rules[i].lo[d],
+                        rules[i].hi[d], prune_bits[d]);
+            }
+        }
+        if (rs->r_rules != NULL) {
+            rs->r_rules[num++].pri = rules[i].pri;
+        } else {
+            rs->p_rules[num++].pri = rules[i].pri;
+        }
+    }
+    free(rules);
+
+    printf("%d rules pruned: %d shadowed, %d merged, %d left\n",
+            rs->num - num, shadowed, merged, num);
+    rs->num = num;
+
+    return shadowed + merged;
+}
+
 void load_trace(struct trace *t, const char *tf)
 {
     FILE *trace_fp;
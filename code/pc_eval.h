@@ -37,6 +37,8 @@
 
 #define CACHE_LINE_SIZE 64 /* 64 bytes */
 
+#define BURST_MAX 32 /* packets classified together */
+
 #define ALIGN(size, align) ({ \
         const typeof(align) __align = align; \
         ((size) + (__align - 1)) & ~(__align - 1);})
@@ -54,7 +56,8 @@ enum {
     ALGO_INV = -1,
     ALGO_HS = 0,
     ALGO_TSS = 1,
-    ALGO_NUM = 2
+    ALGO_DELTA = 2,
+    ALGO_NUM = 3
 };
 
 // smart-update
@@ -125,7 +128,9 @@ struct algo_t {
     void (*load_rules)(struct rule_set *, const char *);
     int (*build)(const struct rule_set *, void *);
     int (*insrt_update)(const struct rule_set *, void *);
+    int (*delete_update)(const struct rule_set *, void *);  // NULL if unsupported
     int (*classify)(const struct packet *, const void *);
+    int (*classify_burst)(const struct packet *, int, int *, const void *);
     int (*search)(const struct trace *, const void *);
     void (*cleanup)(void *);
     int (*build_estimate)(const struct rule_set *, void *);
@@ -139,6 +144,7 @@ uint64_t make_timediff(struct timeval *start, struct timeval *stop);
 void load_cb_rules(struct rule_set *rs, const char *rf);     // classbench rule format
 void load_prfx_rules(struct rule_set *rs, const char *rf);   // prefix rule format
 void unload_rules(struct rule_set *rs);
+int prune_rules(struct rule_set *rs);  // drop shadowed rules, merge the rest
 
 void load_trace(struct trace *t, const char *tf);
 void unload_trace(struct trace *t);
@@ -12,221 +12,917 @@
  */
 
 #include <stdio.h>
+#include <limits.h>
 #include <assert.h>
+#include <immintrin.h>
 #include "tss.h"
 #include "uthash.h"
 
-int field_widths[DIM_MAX] = {4, 4, 2, 2, 1};    /* bytes */
+struct tss_conf tss_conf = {
+    TSS_TABLE_OPEN,
+    0,
+    0
+};
 
-static int tpl_is_equal(int *t1, int *t2, int num)
+static const int field_bits[DIM_MAX] = {32, 32, 16, 16, 8};
+
+/* the unmasked key of a packet or a rule */
+static inline void fill_key(struct tss_key *k, const union point *dim)
+{
+    k->w[0] = (uint64_t)dim[DIM_SIP].u32 << 32 | dim[DIM_DIP].u32;
+    k->w[1] = (uint64_t)dim[DIM_SPORT].u16 << 32 |
+        (uint64_t)dim[DIM_DPORT].u16 << 16 | dim[DIM_PROTO].u8;
+}
+
+static inline void mask_key(struct tss_key *k, const struct tss_key *v,
+        const struct tss_key *mask)
+{
+    k->w[0] = v->w[0] & mask->w[0];
+    k->w[1] = v->w[1] & mask->w[1];
+}
+
+/* done once per tuple or rule, len[32, 32, 0, 16, 8] */
+static void set_len_mask(struct tss_key *mask, const int *len)
+{
+    uint64_t m[DIM_MAX];
+    int j;
+
+    for (j = 0; j < DIM_MAX; j++) {
+        m[j] = len[j] == 0 ? 0 :
+            ((1ULL << field_bits[j]) - 1) & ~((1ULL << (field_bits[j] - len[j])) - 1);
+    }
+    mask->w[0] = m[DIM_SIP] << 32 | m[DIM_DIP];
+    mask->w[1] = m[DIM_SPORT] << 32 | m[DIM_DPORT] << 16 | m[DIM_PROTO];
+}
+
+static void create_tss_rule(struct tss_rule *tr, const struct prfx_rule *r)
+{
+    struct tss_key v;
+
+    fill_key(&v, r->dim);
+    set_len_mask(&tr->mask, r->len);
+    mask_key(&tr->value, &v, &tr->mask);
+    tr->pri = r->pri;
+}
+
+static inline int match_tss_rule(const struct tss_rule *tr,
+        const struct tss_key *pkey)
+{
+    return ((pkey->w[0] & tr->mask.w[0]) == tr->value.w[0]) &
+        ((pkey->w[1] & tr->mask.w[1]) == tr->value.w[1]);
+}
+
+
+/*
+ * open addressing table
+ */
+#define TSS_TAG_EMPTY 0
+#define TSS_TAG_DELETED 1
+#define TSS_TAG(h) (0x80 | (h) >> 25)
+#define TSS_TAG_USED(tag) ((tag) & 0x80)
+
+__attribute__((target("sse4.2")))
+static uint32_t tss_hash_crc32c(const struct tss_key *k)
+{
+    return (uint32_t)_mm_crc32_u64(_mm_crc32_u64(0, k->w[0]), k->w[1]);
+}
+
+static uint32_t tss_hash_mul(const struct tss_key *k)
+{
+    uint64_t h = (k->w[0] ^ k->w[1] * 0xc2b2ae3d27d4eb4fULL) * 0x9e3779b97f4a7c15ULL;
+
+    return (uint32_t)(h >> 32);
+}
+
+static uint32_t (*tss_hash)(const struct tss_key *) = tss_hash_mul;
+
+static void select_tss_hash(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        tss_hash = tss_hash_crc32c;
+    } else {
+        tss_hash = tss_hash_mul;
+    }
+
+    return;
+}
+
+/* the tags and slots of @groups groups in one block */
+static int init_tss_table(struct tss_table *t, uint32_t groups)
+{
+    size_t slots = (size_t)groups * TSS_GROUP;
+    void *mem;
+
+    if (posix_memalign(&mem, CACHE_LINE_SIZE,
+                slots * (1 + sizeof(*t->slots))) != 0) {
+        return -1;
+    }
+    t->tags = mem;
+    t->slots = (struct hash_entry *)(t->tags + slots);
+    memset(t->tags, TSS_TAG_EMPTY, slots);
+    t->group_mask = groups - 1;
+    t->num = 0;
+    t->dead = 0;
+
+    return 0;
+}
+
+static inline uint32_t match_tss_tags(const uint8_t *tags, uint8_t tag)
+{
+    __m128i g = _mm_load_si128((const __m128i *)tags);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(tag)));
+}
+
+static inline struct hash_entry *find_tss_slot(const struct tss_table *t,
+        const struct tss_key *key, uint32_t h)
+{
+    uint32_t g = h & t->group_mask, m;
+    const uint8_t *tags;
+    struct hash_entry *e;
+
+    /* the load factor leaves an empty slot to stop at */
+    for (;;) {
+        tags = &t->tags[g * TSS_GROUP];
+        for (m = match_tss_tags(tags, TSS_TAG(h)); m != 0; m &= m - 1) {
+            e = &t->slots[g * TSS_GROUP + __builtin_ctz(m)];
+            if (e->key.w[0] == key->w[0] && e->key.w[1] == key->w[1]) {
+                return e;
+            }
+        }
+        if (match_tss_tags(tags, TSS_TAG_EMPTY) != 0) {
+            return NULL;
+        }
+        g = (g + 1) & t->group_mask;
+    }
+}
+
+/* takes the first empty or deleted slot on the probe sequence of @h */
+static struct hash_entry *put_tss_slot(struct tss_table *t,
+        const struct tss_key *key, uint32_t h)
+{
+    uint32_t g = h & t->group_mask, m, i;
+    const uint8_t *tags;
+
+    for (;;) {
+        tags = &t->tags[g * TSS_GROUP];
+        m = match_tss_tags(tags, TSS_TAG_EMPTY) |
+            match_tss_tags(tags, TSS_TAG_DELETED);
+        if (m != 0) {
+            break;
+        }
+        g = (g + 1) & t->group_mask;
+    }
+    i = g * TSS_GROUP + __builtin_ctz(m);
+    if (t->tags[i] == TSS_TAG_DELETED) {
+        t->dead--;
+    }
+    t->tags[i] = TSS_TAG(h);
+    t->slots[i].key = *key;
+    t->num++;
+
+    return &t->slots[i];
+}
+
+/*
+ * a deleted slot keeps later keys of its probe sequence reachable, unless
+ * its group has an empty slot that ends the probes there anyway
+ */
+static void del_tss_slot(struct tss_table *t, struct hash_entry *e)
 {
+    uint32_t i = e - t->slots;
+    const uint8_t *tags = &t->tags[i / TSS_GROUP * TSS_GROUP];
+
+    if (match_tss_tags(tags, TSS_TAG_EMPTY) != 0) {
+        t->tags[i] = TSS_TAG_EMPTY;
+    } else {
+        t->tags[i] = TSS_TAG_DELETED;
+        t->dead++;
+    }
+    t->num--;
+
+    return;
+}
+
+/* moves the keys into @groups groups, which drops the deleted slots */
+static int rehash_tss_table(struct tss_table *t, uint32_t groups)
+{
+    struct tss_table n;
+    struct hash_entry *e;
+    uint32_t i;
+
+    if (init_tss_table(&n, groups) != 0) {
+        return -1;
+    }
+    for (i = 0; i < (t->group_mask + 1) * TSS_GROUP; i++) {
+        if (!TSS_TAG_USED(t->tags[i])) {
+            continue;
+        }
+        e = put_tss_slot(&n, &t->slots[i].key, tss_hash(&t->slots[i].key));
+        *e = t->slots[i];
+    }
+    free(t->tags);
+    *t = n;
+
+    return 0;
+}
+
+/*
+ * up to 7/8 of the slots are used or deleted. A full table doubles, unless
+ * deleted slots are most of it and a rehash in place frees enough.
+ */
+static struct hash_entry *add_tss_slot(struct tss_table *t,
+        const struct tss_key *key, uint32_t h)
+{
+    uint32_t limit = (t->group_mask + 1) * TSS_GROUP * 7;
+
+    if ((t->num + t->dead + 1) * 8 > limit &&
+            rehash_tss_table(t, (t->num + 1) * 16 > limit ?
+                (t->group_mask + 1) << 1 : t->group_mask + 1) != 0) {
+        return NULL;
+    }
+
+    return put_tss_slot(t, key, h);
+}
+
+static size_t tss_table_memory(const struct tss_table *t)
+{
+    return (size_t)(t->group_mask + 1) * TSS_GROUP * (1 + sizeof(*t->slots));
+}
+
+/*
+ * entries of a tuple in either table, @h is tss_hash() of the key
+ */
+static inline struct hash_entry *find_tss_entry(const struct tss_node *tn,
+        const struct tss_key *key, uint32_t h)
+{
+    struct tss_uh_entry *ue;
+
+    if (tn->table == TSS_TABLE_UTHASH) {
+        HASH_FIND(hh, tn->ht, key, sizeof(*key), ue);
+        return ue != NULL ? &ue->e : NULL;
+    }
+
+    return find_tss_slot(&tn->tbl, key, h);
+}
+
+/* a new entry of @key, which the tuple does not have yet */
+static struct hash_entry *add_tss_entry(struct tss_node *tn,
+        const struct tss_key *key, uint32_t h)
+{
+    struct tss_uh_entry *ue;
+
+    if (tn->table == TSS_TABLE_UTHASH) {
+        if ((ue = malloc(sizeof(*ue))) == NULL) {
+            return NULL;
+        }
+        ue->e.key = *key;
+        HASH_ADD(hh, tn->ht, e.key, sizeof(*key), ue);
+        return &ue->e;
+    }
+
+    return add_tss_slot(&tn->tbl, key, h);
+}
+
+/* drops an entry of the tuple with its rules */
+static void del_tss_entry(struct tss_node *tn, struct hash_entry *e)
+{
+    struct tss_uh_entry *ue;
+
+    SAFE_FREE(e->rules);
+    if (tn->table == TSS_TABLE_UTHASH) {
+        ue = (struct tss_uh_entry *)e;
+        HASH_DEL(tn->ht, ue);
+        SAFE_FREE(ue);
+        return;
+    }
+
+    del_tss_slot(&tn->tbl, e);
+
+    return;
+}
+
+static void for_tss_entries(struct tss_node *tn,
+        void (*fn)(struct hash_entry *, void *), void *arg)
+{
+    struct tss_uh_entry *ue, *tmp;
+    uint32_t i;
+
+    if (tn->table == TSS_TABLE_UTHASH) {
+        HASH_ITER(hh, tn->ht, ue, tmp) {
+            fn(&ue->e, arg);
+        }
+        return;
+    }
+
+    for (i = 0; i < (tn->tbl.group_mask + 1) * TSS_GROUP; i++) {
+        if (TSS_TAG_USED(tn->tbl.tags[i])) {
+            fn(&tn->tbl.slots[i], arg);
+        }
+    }
+
+    return;
+}
+
+static size_t tss_entry_num(const struct tss_node *tn)
+{
+    return tn->table == TSS_TABLE_UTHASH ? HASH_COUNT(tn->ht) : tn->tbl.num;
+}
+
+static void count_entry_rules(struct hash_entry *e, void *arg)
+{
+    *(size_t *)arg += e->num;
+}
+
+static size_t tss_node_memory(struct tss_node *tn)
+{
+    size_t rules = 0;
+
+    for_tss_entries(tn, count_entry_rules, &rules);
+    rules *= sizeof(struct tss_rule);
+    if (tn->table == TSS_TABLE_UTHASH) {
+        return rules + HASH_COUNT(tn->ht) * sizeof(*tn->ht) +
+            HASH_OVERHEAD(hh, tn->ht);
+    }
+
+    return rules + tss_table_memory(&tn->tbl);
+}
+
+static void free_entry_rules(struct hash_entry *e, void *arg)
+{
+    SAFE_FREE(e->rules);
+}
+
+static void free_tss_entries(struct tss_node *tn)
+{
+    struct tss_uh_entry *ue, *tmp;
+
+    for_tss_entries(tn, free_entry_rules, NULL);
+    if (tn->table == TSS_TABLE_UTHASH) {
+        HASH_ITER(hh, tn->ht, ue, tmp) {
+            HASH_DEL(tn->ht, ue);
+            SAFE_FREE(ue);
+        }
+    } else {
+        SAFE_FREE(tn->tbl.tags);
+    }
+
+    return;
+}
+
+/* the tuple of lengths @len, NULL if there is none yet */
+static struct tss_node *find_tss_node(const struct tss_space *ts,
+        const int *len)
+{
+    struct tss_tuple_idx *ix;
+
+    HASH_FIND(hh, ts->idx, len, sizeof(ix->tuple), ix);
+
+    return ix != NULL ? &ts->tpls[ix->idx] : NULL;
+}
+
+/* a tuple of lengths @len at the end of the array */
+static struct tss_node *add_tss_node(struct tss_space *ts, const int *len,
+        int pri)
+{
+    struct tss_node *tn, *grown;
+    struct tss_tuple_idx *ix;
+    int cap, j;
+
+    if (ts->num == ts->cap) {
+        cap = ts->cap ? ts->cap << 1 : 16;
+        if ((grown = realloc(ts->tpls, cap * sizeof(*grown))) == NULL) {
+            return NULL;
+        }
+        ts->tpls = grown;
+        ts->cap = cap;
+    }
+
+    tn = &ts->tpls[ts->num];
+    bzero(tn, sizeof(*tn));
+    if ((ix = malloc(sizeof(*ix))) == NULL) {
+        return NULL;
+    }
+    tn->table = tss_conf.table;
+    if (tn->table == TSS_TABLE_OPEN && init_tss_table(&tn->tbl, 1) != 0) {
+        SAFE_FREE(ix);
+        return NULL;
+    }
+    for (j = 0; j < DIM_MAX; j++) {
+        tn->tuple[j] = ix->tuple[j] = len[j];
+    }
+    set_len_mask(&tn->mask, len);
+    tn->highest_pri = pri;
+    tn->tpl_id = ts->next_id++;
+    tn->ix = ix;
+    ix->idx = ts->num++;
+    HASH_ADD(hh, ts->idx, tuple, sizeof(ix->tuple), ix);
+
+    return tn;
+}
+
+/*
+ * Bloom filter
+ */
+static inline uint32_t tss_bloom_index(const struct tss_bloom *bf,
+        uint32_t h, int tpl_id)
+{
+    uint64_t x = ((uint64_t)tpl_id << 32 | h) * 0x9e3779b97f4a7c15ULL;
+
+    return (x >> 32) & bf->block_mask;
+}
+
+static inline const uint64_t *tss_bloom_block(const struct tss_bloom *bf,
+        uint32_t h, int tpl_id)
+{
+    return &bf->blocks[tss_bloom_index(bf, h, tpl_id) * TSS_BLOOM_WORDS];
+}
+
+/* 3 bits of the block taken from the low 27 bits of the hash */
+static inline int test_tss_bloom(const struct tss_bloom *bf, uint32_t h,
+        int tpl_id)
+{
+    const uint64_t *b = tss_bloom_block(bf, h, tpl_id);
+    uint32_t p0 = h & 511, p1 = h >> 9 & 511, p2 = h >> 18 & 511;
+
+    return (b[p0 >> 6] >> (p0 & 63)) & (b[p1 >> 6] >> (p1 & 63)) &
+        (b[p2 >> 6] >> (p2 & 63)) & 1;
+}
+
+/*
+ * the counts of the bits live apart from the filter, lookups never read
+ * them. A bit is set while its count is, a saturated count stays.
+ */
+static void add_tss_bloom(struct tss_bloom *bf, uint32_t h, int tpl_id)
+{
+    uint32_t blk = tss_bloom_index(bf, h, tpl_id);
+    uint64_t *b = &bf->blocks[blk * TSS_BLOOM_WORDS];
+    uint8_t *c = &bf->counts[blk * TSS_BLOOM_BLOCK];
+    uint32_t p[3] = {h & 511, h >> 9 & 511, h >> 18 & 511};
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        b[p[i] >> 6] |= 1ULL << (p[i] & 63);
+        if (c[p[i]] != UINT8_MAX) {
+            c[p[i]]++;
+        }
+    }
+    bf->num++;
+
+    return;
+}
+
+static void del_tss_bloom(struct tss_bloom *bf, uint32_t h, int tpl_id)
+{
+    uint32_t blk = tss_bloom_index(bf, h, tpl_id);
+    uint64_t *b = &bf->blocks[blk * TSS_BLOOM_WORDS];
+    uint8_t *c = &bf->counts[blk * TSS_BLOOM_BLOCK];
+    uint32_t p[3] = {h & 511, h >> 9 & 511, h >> 18 & 511};
     int i;
-    for (i = 0; i < num; i++) {
-        if (t1[i] != t2[i]) {
+
+    for (i = 0; i < 3; i++) {
+        if (c[p[i]] != UINT8_MAX && --c[p[i]] == 0) {
+            b[p[i] >> 6] &= ~(1ULL << (p[i] & 63));
+        }
+    }
+    bf->num--;
+
+    return;
+}
+
+struct bloom_fill {
+    struct tss_bloom *bf;
+    int tpl_id;
+};
+
+static void fill_entry_bloom(struct hash_entry *e, void *arg)
+{
+    struct bloom_fill *f = arg;
+
+    add_tss_bloom(f->bf, tss_hash(&e->key), f->tpl_id);
+}
+
+/*
+ * sizes the filter to ts->bloom bits per key up to TSS_BLOOM_MAX and
+ * fills it again if it has to grow, keys added since it was sized are in
+ * it already
+ */
+static int size_tss_bloom(struct tss_space *ts)
+{
+    struct bloom_fill f;
+    size_t keys = 0, blocks = 1;
+    void *mem;
+    int i;
+
+    for (i = 0; i < ts->num; i++) {
+        keys += tss_entry_num(&ts->tpls[i]);
+    }
+    while (blocks * TSS_BLOOM_BLOCK < keys * ts->bloom &&
+            blocks * CACHE_LINE_SIZE < TSS_BLOOM_MAX) {
+        blocks <<= 1;
+    }
+    if (ts->bf.blocks != NULL && blocks <= ts->bf.block_mask + 1) {
+        return 0;
+    }
+
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, blocks * CACHE_LINE_SIZE) != 0) {
+        return -1;
+    }
+    SAFE_FREE(ts->bf.blocks);
+    SAFE_FREE(ts->bf.counts);
+    ts->bf.blocks = mem;
+    if ((ts->bf.counts = calloc(blocks, TSS_BLOOM_BLOCK)) == NULL) {
+        SAFE_FREE(ts->bf.blocks);
+        return -1;
+    }
+    ts->bf.block_mask = blocks - 1;
+    ts->bf.num = 0;
+    memset(ts->bf.blocks, 0, blocks * CACHE_LINE_SIZE);
+
+    f.bf = &ts->bf;
+    for (i = 0; i < ts->num; i++) {
+        f.tpl_id = ts->tpls[i].tpl_id;
+        for_tss_entries(&ts->tpls[i], fill_entry_bloom, &f);
+    }
+
+    return 0;
+}
+
+/*
+ * TupleMerge
+ */
+
+/* the coarser tuple tried first, ip prefixes cut to whole bytes and port ranges dropped */
+static void merge_tuple(int *len, const int *rlen)
+{
+    len[DIM_SIP] = rlen[DIM_SIP] & ~7;
+    len[DIM_DIP] = rlen[DIM_DIP] & ~7;
+    len[DIM_SPORT] = rlen[DIM_SPORT] == 16 ? 16 : 0;
+    len[DIM_DPORT] = rlen[DIM_DPORT] == 16 ? 16 : 0;
+    len[DIM_PROTO] = rlen[DIM_PROTO];
+}
+
+/* a rule fits a tuple no longer than its own lengths */
+static int tss_node_fits(const struct tss_node *tn, const int *rlen)
+{
+    int j;
+
+    for (j = 0; j < DIM_MAX; j++) {
+        if (tn->tuple[j] > rlen[j]) {
             return 0;
         }
     }
+
     return 1;
 }
 
+/* the bucket of @tr in the tuple has room under the collision limit */
+static int tss_node_room(const struct tss_node *tn, const struct tss_rule *tr,
+        int limit)
+{
+    struct hash_entry *e;
+    struct tss_key key;
+
+    mask_key(&key, &tr->value, &tn->mask);
+    e = find_tss_entry(tn, &key, tss_hash(&key));
+
+    return e == NULL || e->num < limit;
+}
 
-static char *create_key(int key_bytes, const union point *dim, int *tuple)
+/*
+ * the tuple a rule goes to. Exact tuples take the rule's own lengths. With
+ * TupleMerge the coarser tuple is tried first, then any tuple the rule
+ * fits; a rule colliding everywhere gets a tuple of its own lengths.
+ */
+static struct tss_node *place_tss_rule(struct tss_space *ts,
+        const struct prfx_rule *r, const struct tss_rule *tr)
 {
-    // tuple[32, 32, 0, 16, 8]
-    int j, offset = 0;
-    union point p;
-    char *key = calloc(key_bytes, sizeof *key);
-    for (j = 0; j < DIM_MAX; j++) {
-        if (!tuple[j]) continue;
-        p.u32 = dim[j].u32 & ~((1U << (field_widths[j] * 8 - tuple[j])) - 1);
-        memcpy(key + offset, &p, field_widths[j]);
-        offset += field_widths[j];
+    struct tss_node *tn;
+    int len[DIM_MAX];
+    int i;
+
+    if (ts->merge > 0) {
+        merge_tuple(len, r->len);
+        if ((tn = find_tss_node(ts, len)) == NULL) {
+            return add_tss_node(ts, len, r->pri);
+        }
+        if (tss_node_room(tn, tr, ts->merge)) {
+            return tn;
+        }
+        for (i = 0; i < ts->num; i++) {
+            if (tss_node_fits(&ts->tpls[i], r->len) &&
+                    tss_node_room(&ts->tpls[i], tr, ts->merge)) {
+                return &ts->tpls[i];
+            }
+        }
+    }
+
+    if ((tn = find_tss_node(ts, r->len)) != NULL) {
+        return tn;
     }
-    assert(offset == key_bytes);
-    return key;
+    return add_tss_node(ts, r->len, r->pri);
 }
 
+/* a rule into its tuple's bucket, buckets keep their rules by priority */
+static int add_tss_rule(struct tss_space *ts, const struct prfx_rule *r)
+{
+    struct tss_node *tn;
+    struct hash_entry *e;
+    struct tss_rule tr, *grown;
+    struct tss_key key;
+    uint32_t h;
+    int i;
+
+    create_tss_rule(&tr, r);
+    if ((tn = place_tss_rule(ts, r, &tr)) == NULL) {
+        return -1;
+    }
+
+    mask_key(&key, &tr.value, &tn->mask);
+    h = tss_hash(&key);
+    if ((e = find_tss_entry(tn, &key, h)) == NULL) {
+        if ((e = add_tss_entry(tn, &key, h)) == NULL) {
+            return -1;
+        }
+        e->num = 0;
+        e->rules = NULL;
+        if (ts->bf.blocks != NULL) {
+            add_tss_bloom(&ts->bf, h, tn->tpl_id);
+        }
+    }
+    if ((grown = realloc(e->rules, (e->num + 1) * sizeof(*grown))) == NULL) {
+        return -1;
+    }
+    e->rules = grown;
+    for (i = e->num; i > 0 && e->rules[i - 1].pri > tr.pri; i--) {
+        e->rules[i] = e->rules[i - 1];
+    }
+    e->rules[i] = tr;
+    e->num++;
+    e->pri = e->rules[0].pri;
 
-static void cpy_tss_node(struct tss_node *p_l_tn, struct tss_node *p_r_tn)
+    /* update highest priority */
+    if (tn->highest_pri > tr.pri) {
+        tn->highest_pri = tr.pri;
+    }
+
+    return 0;
+}
+
+/* the place of a rule in the bucket it would be in with tuple @tn */
+static int find_tss_rule(const struct tss_node *tn, const struct tss_rule *tr,
+        struct hash_entry **ep)
 {
-    if (!p_l_tn || !p_r_tn) return;
+    struct hash_entry *e;
+    struct tss_key key;
     int i;
-    p_l_tn->ht = p_r_tn->ht;
-    for (i = 0; i < DIM_MAX; i++) {
-        p_l_tn->tuple[i] = p_r_tn->tuple[i];
+
+    mask_key(&key, &tr->value, &tn->mask);
+    if ((e = find_tss_entry(tn, &key, tss_hash(&key))) == NULL) {
+        return -1;
     }
-    p_l_tn->key_bytes = p_r_tn->key_bytes;
-    p_l_tn->highest_pri = p_r_tn->highest_pri;
+    for (i = 0; i < e->num && e->rules[i].pri <= tr->pri; i++) {
+        if (e->rules[i].pri == tr->pri &&
+                e->rules[i].value.w[0] == tr->value.w[0] &&
+                e->rules[i].value.w[1] == tr->value.w[1] &&
+                e->rules[i].mask.w[0] == tr->mask.w[0] &&
+                e->rules[i].mask.w[1] == tr->mask.w[1]) {
+            *ep = e;
+            return i;
+        }
+    }
+
+    return -1;
 }
 
-static void swap_tss_node(struct tss_node *p_l_tn, struct tss_node *p_r_tn)
+static void min_entry_pri(struct hash_entry *e, void *arg)
 {
-    if (p_l_tn == p_r_tn) return;
-    struct tss_node *p_tmp_tn = calloc(1, sizeof *p_tmp_tn);
-    cpy_tss_node(p_tmp_tn, p_l_tn);
-    cpy_tss_node(p_l_tn, p_r_tn);
-    cpy_tss_node(p_r_tn, p_tmp_tn);
-    SAFE_FREE(p_tmp_tn);
+    if (*(int *)arg > e->pri) {
+        *(int *)arg = e->pri;
+    }
 }
 
-/* partition list to let left elements <= pivot <= right elements */
-static struct tss_node *part_tss_list(struct tss_head *p_th, struct tss_node *p_l_tn, struct tss_node *p_r_tn)
+/*
+ * a rule out of its bucket, 1 if it was found. An emptied bucket leaves
+ * the table and the filter, and the tuple's highest_pri is found again if
+ * the rule had it; an emptied tuple keeps INT_MAX until it is dropped.
+ */
+static int del_tss_rule(struct tss_space *ts, const struct prfx_rule *r)
 {
-    /* we meet p_r_tn's highest_pri as pivot value */
-    struct tss_node *p_pivot_tn = p_l_tn, *p_trav_tn = p_l_tn;
-    while (p_trav_tn != p_r_tn) {
-        if (p_trav_tn->highest_pri < p_r_tn->highest_pri) {
-            swap_tss_node(p_trav_tn, p_pivot_tn);
-            p_pivot_tn = TAILQ_NEXT(p_pivot_tn, entry);
+    struct tss_node *tn = NULL;
+    struct hash_entry *e = NULL;
+    struct tss_rule tr;
+    int len[DIM_MAX];
+    int i = -1, t;
+
+    create_tss_rule(&tr, r);
+    if (ts->merge > 0) {
+        merge_tuple(len, r->len);
+        if ((tn = find_tss_node(ts, len)) != NULL) {
+            i = find_tss_rule(tn, &tr, &e);
         }
-        p_trav_tn = TAILQ_NEXT(p_trav_tn, entry);
+        for (t = 0; i < 0 && t < ts->num; t++) {
+            if (tss_node_fits(&ts->tpls[t], r->len)) {
+                tn = &ts->tpls[t];
+                i = find_tss_rule(tn, &tr, &e);
+            }
+        }
+    } else if ((tn = find_tss_node(ts, r->len)) != NULL) {
+        i = find_tss_rule(tn, &tr, &e);
+    }
+    if (i < 0) {
+        return 0;
+    }
+
+    e->num--;
+    memmove(&e->rules[i], &e->rules[i + 1], (e->num - i) * sizeof(*e->rules));
+    if (e->num > 0) {
+        e->pri = e->rules[0].pri;
+    } else {
+        if (ts->bf.blocks != NULL) {
+            del_tss_bloom(&ts->bf, tss_hash(&e->key), tn->tpl_id);
+        }
+        del_tss_entry(tn, e);
     }
-    swap_tss_node(p_pivot_tn, p_r_tn);
-    return p_pivot_tn;
+
+    if (tn->highest_pri == tr.pri) {
+        tn->highest_pri = INT_MAX;
+        for_tss_entries(tn, min_entry_pri, &tn->highest_pri);
+    }
+
+    return 1;
 }
 
-/* qsort style */
-void sort_tss_list(struct tss_head *p_th, struct tss_node *p_l_tn, struct tss_node *p_r_tn)
+static int tss_node_cmp(const void *a, const void *b)
 {
-    if (!p_l_tn || !p_r_tn || p_l_tn->tpl_id >= p_r_tn->tpl_id) return;
-    struct tss_node *p_pivot_tn = part_tss_list(p_th, p_l_tn, p_r_tn);
-    sort_tss_list(p_th, p_l_tn, TAILQ_PREV(p_pivot_tn, tss_head, entry));
-    sort_tss_list(p_th, TAILQ_NEXT(p_pivot_tn, entry), p_r_tn);
+    const struct tss_node *l = a, *r = b;
+
+    if (l->highest_pri != r->highest_pri) {
+        return l->highest_pri < r->highest_pri ? -1 : 1;
+    }
+    return l->tpl_id - r->tpl_id;
+}
+
+/* sorts the tuples by highest_pri and points the index at their new places */
+static void sort_tss_space(struct tss_space *ts)
+{
+    int i;
+
+    qsort(ts->tpls, ts->num, sizeof(*ts->tpls), tss_node_cmp);
+    for (i = 0; i < ts->num; i++) {
+        ts->tpls[i].ix->idx = i;
+    }
+
+    return;
 }
 
 int tss_build(const struct rule_set *rs, void *userdata)
 {
-    int i, j, tpl_exist = 0, tpl_num = 0, bytes = 0, hash_overhead = 0, nodes = 0;
-    struct tss_head *p_th = NULL;
-    struct tss_node *p_trav_tn = NULL, *p_tmp_tn = NULL;
-    struct hash_entry *p_he = NULL;
-    char *key;
+    int i;
+    size_t bytes = 0, entries = 0;
+    struct tss_space *ts = NULL;
     if (rs->p_rules == NULL) return -1;
 
+    select_tss_hash();
     if (*(void **) userdata == NULL) {
-        p_th = malloc(sizeof *p_th);
-        TAILQ_INIT(p_th);
+        if ((ts = calloc(1, sizeof(*ts))) == NULL) {
+            return -1;
+        }
+        ts->merge = tss_conf.merge;
+        ts->bloom = tss_conf.bloom;
+        *(struct tss_space **) userdata = ts;
     } else {
-        p_th = *(typeof(p_th) *) userdata;
-        tpl_num = TAILQ_LAST(p_th, tss_head)->tpl_id;
-        tpl_num++;
+        ts = *(typeof(ts) *) userdata;
     }
 
     for (i = 0; i < rs->num; i++) {
-        /* traverse current tss hash_table list */
-        tpl_exist = 0;
-        TAILQ_FOREACH(p_trav_tn, p_th, entry) {
-            if (!tpl_is_equal(p_trav_tn->tuple, rs->p_rules[i].len, DIM_MAX)) continue;
-            tpl_exist = 1;
-            /* hash table operation */
-            key = create_key(p_trav_tn->key_bytes, rs->p_rules[i].dim, rs->p_rules[i].len);
-            HASH_FIND(hh, p_trav_tn->ht, key, p_trav_tn->key_bytes, p_he);
-            if (p_he) {
-                SAFE_FREE(key);
-                if (rs->p_rules[i].pri < p_he->pri) {
-                    p_he->pri = rs->p_rules[i].pri;
-                }
-            } else {
-                p_he = malloc(sizeof *p_he);
-                p_he->key = key;
-                p_he->pri = rs->p_rules[i].pri;
-                HASH_ADD_KEYPTR(hh, p_trav_tn->ht, p_he->key, p_trav_tn->key_bytes, p_he);
-            }
-            /* update highest priority */
-            if (p_trav_tn->highest_pri > rs->p_rules[i].pri) {
-                p_trav_tn->highest_pri = rs->p_rules[i].pri;
-            }
+        if (add_tss_rule(ts, &rs->p_rules[i]) != 0) {
             break;
         }
-        if (tpl_exist) continue;
-        /* new tss list node */
-        p_tmp_tn = malloc(sizeof *p_tmp_tn);
-        p_tmp_tn->highest_pri = rs->p_rules[i].pri;
-        p_tmp_tn->ht = NULL;
-        p_tmp_tn->tpl_id = tpl_num;
-        tpl_num++;
-        /* new tuple */
-        p_tmp_tn->key_bytes = 0;
-        for (j = 0; j < DIM_MAX; j++) {
-            p_tmp_tn->tuple[j] = rs->p_rules[i].len[j];
-            if (rs->p_rules[i].len[j] == 0) continue;
-            p_tmp_tn->key_bytes += field_widths[j];
-        }
-        /* hash table operation */
-        p_he = malloc(sizeof *p_he);
-        p_he->key = create_key(p_tmp_tn->key_bytes, rs->p_rules[i].dim, rs->p_rules[i].len);
-        p_he->pri = rs->p_rules[i].pri;
-        HASH_ADD_KEYPTR(hh, p_tmp_tn->ht, p_he->key, p_tmp_tn->key_bytes, p_he);
-        /* insert the new node to tss list tail */
-        TAILQ_INSERT_TAIL(p_th, p_tmp_tn, entry);
-    }
-
-    /* sort tss list by the highest_pri of node */
-    sort_tss_list(p_th, TAILQ_FIRST(p_th), TAILQ_LAST(p_th, tss_head));
+    }
+
+    /*
+     * the space stays published through userdata, so even a batch that
+     * stopped part way leaves it ordered and, failing a filter, probing
+     * every tuple
+     */
+    sort_tss_space(ts);
+    if (ts->bloom > 0 && size_tss_bloom(ts) != 0) {
+        SAFE_FREE(ts->bf.blocks);
+        SAFE_FREE(ts->bf.counts);
+        ts->bloom = 0;
+        return -1;
+    }
+    if (i < rs->num) {
+        return -1;
+    }
 
     /* statistical numbers */
-    printf("tuple num = %d\n", tpl_num);
-    *(struct tss_head **) userdata = p_th;
-    TAILQ_FOREACH(p_trav_tn, p_th, entry) {
-        hash_overhead += HASH_OVERHEAD(hh, p_trav_tn->ht);
-        nodes += HASH_COUNT(p_trav_tn->ht);
-        bytes += HASH_COUNT(p_trav_tn->ht) * (4 + p_trav_tn->key_bytes);
-        //printf("tuple_id:%d, hash_overhead:%lu bytes\n", p_trav_tn->tpl_id, HASH_OVERHEAD(hh, p_trav_tn->ht));
+    printf("tuple num = %d\n", ts->num);
+    for (i = 0; i < ts->num; i++) {
+        entries += tss_entry_num(&ts->tpls[i]);
+        bytes += tss_node_memory(&ts->tpls[i]);
+    }
+    printf("hash table:%s\n", tss_conf.table == TSS_TABLE_UTHASH ?
+            "uthash" : "open addressing");
+    if (ts->merge > 0) {
+        printf("tuple merge: up to %d colliding rules per bucket\n", ts->merge);
+    }
+    printf("hash items:%zu\n", entries);
+    printf("hash_overhead:%zu bytes; total memory:%zu bytes\n",
+            bytes - entries * sizeof(struct hash_entry), bytes);
+    printf("bytes per entry:%.2f\n", entries ? (double)bytes / entries : 0);
+    if (ts->bf.blocks != NULL) {
+        printf("bloom filter:%u bytes; %.2f bits per key\n",
+                (ts->bf.block_mask + 1) * CACHE_LINE_SIZE,
+                ts->bf.num ? (ts->bf.block_mask + 1) * (double)TSS_BLOOM_BLOCK / ts->bf.num : 0);
     }
-    printf("hash items:%d\n", nodes);
-    printf("hash_overhead:%d bytes; total memory:%d bytes\n", hash_overhead, bytes + hash_overhead);
 
     return 0;
 }
 
-int tss_build_estimate(const struct rule_set *rule_set, void *userdata) {
-    int tuple_num, i, tpl_exist, j;
-    double estimate_build_time;
-    float time_base_operation = 0.01;
-    char *key;
+/* drops the tuples left without rules, the index follows the array */
+static int drop_empty_tuples(struct tss_space *ts)
+{
+    struct tss_node *tn;
+    int i, n = 0;
 
-    if (rule_set->p_rules == NULL) return -1;
+    for (i = 0; i < ts->num; i++) {
+        tn = &ts->tpls[i];
+        if (tss_entry_num(tn) == 0) {
+            free_tss_entries(tn);
+            HASH_DEL(ts->idx, tn->ix);
+            SAFE_FREE(tn->ix);
+            continue;
+        }
+        if (n != i) {
+            ts->tpls[n] = *tn;
+        }
+        n++;
+    }
+    i = ts->num - n;
+    ts->num = n;
 
-    struct tss_head *p_th = NULL;
-    struct tss_node *p_trav_tn = NULL, *p_tmp_tn = NULL;
-    struct hash_entry *p_he = NULL;
+    return i;
+}
 
-    p_th = malloc(sizeof *p_th);
-    TAILQ_INIT(p_th);
+int tss_delete_update(const struct rule_set *rs, void *userdata)
+{
+    struct tss_space *ts;
+    int i, deleted = 0, dropped;
 
-    for (i = 0; i < rule_set->num; i++) {
-        /* traverse current tss hash_table list */
-        tpl_exist = 0;
-        TAILQ_FOREACH(p_trav_tn, p_th, entry) {
-            if (!tpl_is_equal(p_trav_tn->tuple, rule_set->p_rules[i].len, DIM_MAX))
-                continue;
-            tpl_exist = 1;
+    if (*(void **) userdata == NULL || rs->p_rules == NULL) {
+        return -1;
+    }
+    ts = *(typeof(ts) *) userdata;
+
+    for (i = 0; i < rs->num; i++) {
+        deleted += del_tss_rule(ts, &rs->p_rules[i]);
+    }
+
+    /* tuples whose best rule went move down the order */
+    dropped = drop_empty_tuples(ts);
+    sort_tss_space(ts);
+
+    printf("%d of %d rules deleted, %d tuples removed\n", deleted, rs->num,
+            dropped);
+    printf("tuple num = %d\n", ts->num);
+
+    return 0;
+}
+
+/* distinct tuples of the rules */
+static int count_tuples(const struct rule_set *rs)
+{
+    struct tss_tuple_idx *idx = NULL, *ix, *tmp;
+    int i, num = 0;
+
+    for (i = 0; i < rs->num; i++) {
+        HASH_FIND(hh, idx, rs->p_rules[i].len, sizeof(rs->p_rules[i].len), ix);
+        if (ix != NULL || (ix = malloc(sizeof(*ix))) == NULL) {
             continue;
         }
-        if (tpl_exist)
-            continue;
-        /* new tss list node */
-        p_tmp_tn = malloc(sizeof *p_tmp_tn);
-        p_tmp_tn->highest_pri = rule_set->p_rules[i].pri;
-        p_tmp_tn->ht = NULL;
-        p_tmp_tn->tpl_id = tuple_num;
-
-        p_tmp_tn->key_bytes = 0;
-        for (j = 0; j < DIM_MAX; j++) {
-            p_tmp_tn->tuple[j] = rule_set->p_rules[i].len[j];
-            if (rule_set->p_rules[i].len[j] == 0) continue;
-            p_tmp_tn->key_bytes += field_widths[j];
-        }
-        /* hash table operation */
-        p_he = malloc(sizeof *p_he);
-        p_he->key = create_key(p_tmp_tn->key_bytes, rule_set->p_rules[i].dim, rule_set->p_rules[i].len);
-        p_he->pri = rule_set->p_rules[i].pri;
-        HASH_ADD_KEYPTR(hh, p_tmp_tn->ht, p_he->key, p_tmp_tn->key_bytes, p_he);
-        /* insert the new node to tss list tail */
-        TAILQ_INSERT_TAIL(p_th, p_tmp_tn, entry);
-
-        tuple_num++;
+        memcpy(ix->tuple, rs->p_rules[i].len, sizeof(ix->tuple));
+        ix->idx = num++;
+        HASH_ADD(hh, idx, tuple, sizeof(ix->tuple), ix);
     }
+    HASH_ITER(hh, idx, ix, tmp) {
+        HASH_DEL(idx, ix);
+        SAFE_FREE(ix);
+    }
+
+    return num;
+}
+
+int tss_build_estimate(const struct rule_set *rule_set, void *userdata) {
+    int tuple_num;
+    double estimate_build_time;
+    float time_base_operation = 0.01;
+
+    if (rule_set->p_rules == NULL) return -1;
+
+    tuple_num = count_tuples(rule_set);
     printf("Tuple num = %d\n", tuple_num);
     printf("Rule num = %d\n", rule_set->num);
     estimate_build_time=time_base_operation*(tuple_num*(tuple_num-1)/2.0+(rule_set->num-tuple_num)*tuple_num);
@@ -235,100 +931,20 @@ int tss_build_estimate(const struct rule_set *rule_set, void *userdata) {
 }
 
 int tss_update_estimate(const struct rule_set *rule_set, const struct rule_set *u_rule_set, void *userdata) {
-    int tuple_num, u_tuple_num, i, tpl_exist, j;
+    int tuple_num, u_tuple_num;
     float estimate_update_time;
     float time_base_operation = 0.01;
-    char *key;
     uint64_t timediff;
     struct timeval starttime, stoptime;
 
     if (rule_set->p_rules == NULL) return -1;
 
-    struct tss_head *p_th = NULL;
-    struct tss_node *p_trav_tn = NULL, *p_tmp_tn = NULL;
-    struct hash_entry *p_he = NULL;
-
-    p_th = malloc(sizeof *p_th);
-    TAILQ_INIT(p_th);
-
-    tuple_num=0;
-    u_tuple_num=0;
-    for (i = 0; i < rule_set->num; i++) {
-        /* traverse current tss hash_table list */
-        tpl_exist = 0;
-        TAILQ_FOREACH(p_trav_tn, p_th, entry) {
-            if (!tpl_is_equal(p_trav_tn->tuple, rule_set->p_rules[i].len, DIM_MAX))
-                continue;
-            tpl_exist = 1;
-            continue;
-        }
-        if (tpl_exist)
-            continue;
-        /* new tss list node */
-        p_tmp_tn = malloc(sizeof *p_tmp_tn);
-        p_tmp_tn->highest_pri = rule_set->p_rules[i].pri;
-        p_tmp_tn->ht = NULL;
-        p_tmp_tn->tpl_id = tuple_num;
-
-        p_tmp_tn->key_bytes = 0;
-        for (j = 0; j < DIM_MAX; j++) {
-            p_tmp_tn->tuple[j] = rule_set->p_rules[i].len[j];
-            if (rule_set->p_rules[i].len[j] == 0) continue;
-            p_tmp_tn->key_bytes += field_widths[j];
-        }
-        /* hash table operation */
-        p_he = malloc(sizeof *p_he);
-        p_he->key = create_key(p_tmp_tn->key_bytes, rule_set->p_rules[i].dim, rule_set->p_rules[i].len);
-        p_he->pri = rule_set->p_rules[i].pri;
-        HASH_ADD_KEYPTR(hh, p_tmp_tn->ht, p_he->key, p_tmp_tn->key_bytes, p_he);
-        /* insert the new node to tss list tail */
-        TAILQ_INSERT_TAIL(p_th, p_tmp_tn, entry);
-
-        tuple_num++;
-    }
+    tuple_num = count_tuples(rule_set);
     printf("Original tuple num = %d\n", tuple_num);
     printf("Original rule num = %d\n", rule_set->num);
-    u_tuple_num=tuple_num;
-
-    p_th = malloc(sizeof *p_th);
-    TAILQ_INIT(p_th);
 
     gettimeofday(&starttime, NULL);
-    for (i = 0; i < u_rule_set->num; i++) {
-        /* traverse current tss hash_table list */
-        tpl_exist = 0;
-        TAILQ_FOREACH(p_trav_tn, p_th, entry) {
-            if (!tpl_is_equal(p_trav_tn->tuple, u_rule_set->p_rules[i].len, DIM_MAX))
-                continue;
-            tpl_exist = 1;
-            continue;
-        }
-        if (tpl_exist)
-            continue;
-        /* new tss list node */
-        p_tmp_tn = malloc(sizeof *p_tmp_tn);
-        p_tmp_tn->highest_pri = u_rule_set->p_rules[i].pri;
-        p_tmp_tn->ht = NULL;
-        p_tmp_tn->tpl_id = tuple_num;
-
-        p_tmp_tn->key_bytes = 0;
-        for (j = 0; j < DIM_MAX; j++) {
-            p_tmp_tn->tuple[j] = u_rule_set->p_rules[i].len[j];
-            if (u_rule_set->p_rules[i].len[j] == 0) continue;
-            p_tmp_tn->key_bytes += field_widths[j];
-        }
-        /* hash table operation */
-        p_he = malloc(sizeof *p_he);
-        p_he->key = create_key(p_tmp_tn->key_bytes, u_rule_set->p_rules[i].dim, u_rule_set->p_rules[i].len);
-        p_he->pri = u_rule_set->p_rules[i].pri;
-        HASH_ADD_KEYPTR(hh, p_tmp_tn->ht, p_he->key, p_tmp_tn->key_bytes, p_he);
-        /* insert the new node to tss list tail */
-        TAILQ_INSERT_TAIL(p_th, p_tmp_tn, entry);
-
-        tuple_num++;
-    }
-    u_tuple_num=tuple_num-u_tuple_num;
-    tuple_num-=u_tuple_num;
+    u_tuple_num = count_tuples(u_rule_set);
 
     printf("Updating tuple num = %d\n", u_tuple_num);
     printf("Updating rule num = %d\n", u_rule_set->num);
@@ -345,62 +961,230 @@ int tss_update_estimate(const struct rule_set *rule_set, const struct rule_set *
 }
 
 
-int tss_classify(const struct packet *pkt, const void *userdata)
+/* what lookups did, counted apart from the timed ones */
+struct tss_lookup_stats {
+    uint64_t pkts;
+    uint64_t probes;    /* tuples whose table was probed */
+    uint64_t skips;     /* tuples the Bloom filter ruled out */
+    uint64_t checks;    /* rules of merged buckets matched against a packet */
+};
+
+/* the first rule of a merged bucket the packet matches, if it beats @ret */
+static inline int match_tss_bucket(const struct hash_entry *e,
+        const struct tss_key *pkey, int ret, struct tss_lookup_stats *st)
 {
-    struct tss_head *p_th = *(typeof(p_th) *) userdata;
-    struct tss_node *p_trav_tn = NULL;
+    int i;
+
+    for (i = 0; i < e->num; i++) {
+        if (ret != -1 && e->rules[i].pri >= ret) {
+            break;
+        }
+        if (st != NULL) {
+            st->checks++;
+        }
+        if (match_tss_rule(&e->rules[i], pkey)) {
+            return e->rules[i].pri;
+        }
+    }
+
+    return -1;
+}
+
+static inline int tss_lookup(const struct tss_space *ts,
+        const struct packet *pkt, struct tss_lookup_stats *st)
+{
+    const struct tss_node *tn = NULL;
     struct hash_entry *p_he = NULL;
-    char *key;
-    int ret = -1;
+    struct tss_key pkey, key;
+    uint32_t h;
+    int i, pri, ret = -1;
 
-    TAILQ_FOREACH(p_trav_tn, p_th, entry) {
-        //printf("\ntuple id:%d, current highest_pri:%d\n", p_trav_tn->tpl_id, p_trav_tn->highest_pri);
-        if (ret != -1 && ret <= p_trav_tn->highest_pri) {
-            return ret;
+    fill_key(&pkey, pkt->val);
+    for (i = 0; i < ts->num; i++) {
+        tn = &ts->tpls[i];
+        if (ret != -1 && ret <= tn->highest_pri) {
+            break;
         }
-        key = create_key(p_trav_tn->key_bytes, pkt->val, p_trav_tn->tuple);
-        HASH_FIND(hh, p_trav_tn->ht, key, p_trav_tn->key_bytes, p_he);
-        SAFE_FREE(key);
+        mask_key(&key, &pkey, &tn->mask);
+        h = tss_hash(&key);
+        if (ts->bloom > 0 && !test_tss_bloom(&ts->bf, h, tn->tpl_id)) {
+            if (st != NULL) {
+                st->skips++;
+            }
+            continue;
+        }
+        if (st != NULL) {
+            st->probes++;
+        }
+        p_he = find_tss_entry(tn, &key, h);
         if (!p_he) continue;
-        //printf("....matched rule:%d\n", p_he->pri);
-        if (ret == -1 || p_he->pri < ret) {
-            ret = p_he->pri;
+        /* every rule in a bucket of an exact tuple matches */
+        pri = ts->merge > 0 ? match_tss_bucket(p_he, &pkey, ret, st) : p_he->pri;
+        if (pri != -1 && (ret == -1 || pri < ret)) {
+            ret = pri;
         }
     }
+    if (st != NULL) {
+        st->pkts++;
+    }
+
     return ret;
 }
 
-int tss_search(const struct trace *t, const void *userdata)
+int tss_classify(const struct packet *pkt, const void *userdata)
 {
-    int i, c;
+    return tss_lookup(*(const struct tss_space **) userdata, pkt, NULL);
+}
 
-    for (i = 0; i < t->num; i++) {
-        if ((c = tss_classify(&t->pkts[i], userdata)) != t->pkts[i].match) {
-            //fprintf(stderr, "pkt[%d] match:%d, classify:%d\n", i+1, t->pkts[i].match+1, c+1);
-            //return -1;
+/* pulls in the line a probe of @h reads first */
+static inline void prefetch_tss_entry(const struct tss_node *tn, uint32_t h)
+{
+    if (tn->table == TSS_TABLE_OPEN) {
+        __builtin_prefetch(&tn->tbl.tags[(h & tn->tbl.group_mask) * TSS_GROUP]);
+    }
+}
+
+/*
+ * up to BURST_MAX packets a tuple at a time. The keys of all packets still
+ * active are hashed and their lines prefetched before the first compare,
+ * so their misses overlap. A packet leaves once its best rule beats the
+ * tuple's, as every later tuple is worse still.
+ */
+static void tss_lookup_burst(const struct tss_space *ts,
+        const struct packet *pkts, int n, int *res)
+{
+    const struct tss_node *tn;
+    struct hash_entry *e;
+    struct tss_key pkey[BURST_MAX], key[BURST_MAX];
+    uint32_t h[BURST_MAX];
+    int act[BURST_MAX], probe[BURST_MAX];
+    const int *list;
+    int i, j, k, na, np, pri;
+
+    for (j = 0; j < n; j++) {
+        fill_key(&pkey[j], pkts[j].val);
+        res[j] = -1;
+        act[j] = j;
+    }
+    na = n;
+
+    for (i = 0; i < ts->num && na > 0; i++) {
+        tn = &ts->tpls[i];
+
+        for (j = np = 0; j < na; j++) {
+            k = act[j];
+            if (res[k] != -1 && res[k] <= tn->highest_pri) {
+                continue;
+            }
+            act[np++] = k;
+            mask_key(&key[k], &pkey[k], &tn->mask);
+            h[k] = tss_hash(&key[k]);
+            if (ts->bloom > 0) {
+                __builtin_prefetch(tss_bloom_block(&ts->bf, h[k], tn->tpl_id));
+            } else {
+                prefetch_tss_entry(tn, h[k]);
+            }
         }
+        na = np;
+        list = act;
+
+        /* the filter's lines are in, the tables of what passes are next */
+        if (ts->bloom > 0) {
+            for (j = np = 0; j < na; j++) {
+                k = act[j];
+                if (test_tss_bloom(&ts->bf, h[k], tn->tpl_id)) {
+                    prefetch_tss_entry(tn, h[k]);
+                    probe[np++] = k;
+                }
+            }
+            list = probe;
+        }
+
+        for (j = 0; j < np; j++) {
+            k = list[j];
+            if ((e = find_tss_entry(tn, &key[k], h[k])) == NULL) {
+                continue;
+            }
+            pri = ts->merge > 0 ?
+                match_tss_bucket(e, &pkey[k], res[k], NULL) : e->pri;
+            if (pri != -1 && (res[k] == -1 || pri < res[k])) {
+                res[k] = pri;
+            }
+        }
+    }
+
+    return;
+}
+
+int tss_classify_burst(const struct packet *pkts, int n, int *res, const void *userdata)
+{
+    const struct tss_space *ts = *(typeof(ts) *) userdata;
+    int i, m;
+
+    for (i = 0; i < n; i += BURST_MAX) {
+        m = n - i < BURST_MAX ? n - i : BURST_MAX;
+        tss_lookup_burst(ts, &pkts[i], m, &res[i]);
+    }
+
+    return 0;
+}
+
+int tss_search(const struct trace *t, const void *userdata)
+{
+    int i, m;
+    int res[BURST_MAX];
+
+    for (i = 0; i < t->num; i += BURST_MAX) {
+        m = t->num - i < BURST_MAX ? t->num - i : BURST_MAX;
+        tss_classify_burst(&t->pkts[i], m, res, userdata);
     }
 
     return 0;
 }
 
+void tss_search_stats(const struct trace *t, const void *userdata)
+{
+    const struct tss_space *ts = *(typeof(ts) *) userdata;
+    struct tss_lookup_stats st = {0, 0, 0, 0};
+    int i;
+
+    for (i = 0; i < t->num; i++) {
+        tss_lookup(ts, &t->pkts[i], &st);
+    }
+    if (st.pkts == 0) {
+        return;
+    }
+
+    printf("Tuples probed per lookup: %.2f of %d\n",
+            (double)st.probes / st.pkts, ts->num);
+    if (ts->merge > 0) {
+        printf("Rules checked per lookup: %.2f\n", (double)st.checks / st.pkts);
+    }
+    if (ts->bloom > 0) {
+        printf("Probes skipped by the Bloom filter: %.2f%%\n", st.skips ?
+                100.0 * st.skips / (st.skips + st.probes) : 0);
+    }
+
+    return;
+}
+
 void tss_cleanup(void *userdata)
 {
-    struct tss_head *p_th = *(typeof(p_th) *) userdata;
-    struct tss_node *p_trav_tn;
-    struct hash_entry *p_he, *p_tmp_he;
+    struct tss_space *ts = *(typeof(ts) *) userdata;
+    struct tss_tuple_idx *ix, *tmp;
+    int i;
 
-    while (!TAILQ_EMPTY(p_th)) {
-        p_trav_tn = TAILQ_FIRST(p_th);
-        TAILQ_REMOVE(p_th, p_trav_tn, entry);
-        HASH_ITER(hh, p_trav_tn->ht, p_he, p_tmp_he) {
-            HASH_DEL(p_trav_tn->ht, p_he);
-            SAFE_FREE(p_he->key);
-            SAFE_FREE(p_he);
-        }
-        SAFE_FREE(p_trav_tn);
+    for (i = 0; i < ts->num; i++) {
+        free_tss_entries(&ts->tpls[i]);
+    }
+    HASH_ITER(hh, ts->idx, ix, tmp) {
+        HASH_DEL(ts->idx, ix);
+        SAFE_FREE(ix);
     }
-    SAFE_FREE(p_th);
+    SAFE_FREE(ts->tpls);
+    SAFE_FREE(ts->bf.blocks);
+    SAFE_FREE(ts->bf.counts);
+    SAFE_FREE(ts);
 
     return;
 }
@@ -14,31 +14,126 @@
 #ifndef __TSS_H__
 #define __TSS_H__
 
-#include <sys/queue.h>
 #include "pc_eval.h"
 #include "uthash.h"
 
-struct hash_entry {
-    char *key;
+/*
+ * the 5 fields at fixed places in two words, sip:dip and sport:dport:proto,
+ * so a tuple's key is a packet's key ANDed with the tuple's mask
+ */
+struct tss_key {
+    uint64_t w[2];
+};
+
+/* a rule in a bucket, matched on its own lengths */
+struct tss_rule {
+    struct tss_key value;
+    struct tss_key mask;
     int pri;
+};
+
+/* the rules with a masked key */
+struct hash_entry {
+    struct tss_key key;
+    int pri;                    /* of rules[0] */
+    int num;
+    struct tss_rule *rules;     /* by priority */
+};
+
+/* an entry chained by uthash */
+struct tss_uh_entry {
+    struct hash_entry e;
     UT_hash_handle hh;
 };
 
+#define TSS_GROUP 16    /* slots whose tags a probe compares at once */
+
+/*
+ * open addressing over groups of TSS_GROUP slots. A slot's tag byte holds
+ * 7 bits of the key's hash, a probe compares a group's tags in one SIMD
+ * instruction and only reads the keys whose tags match. A group with an
+ * empty slot ends a probe.
+ */
+struct tss_table {
+    uint8_t *tags;              /* 0 if empty, 1 if deleted, 0x80 | hash
+                                   bits if used */
+    struct hash_entry *slots;   /* behind the tags in the same block */
+    uint32_t group_mask;        /* groups - 1, groups are a power of two */
+    uint32_t num;
+    uint32_t dead;              /* deleted slots probes still pass */
+};
+
+enum {
+    TSS_TABLE_UTHASH = 0,
+    TSS_TABLE_OPEN = 1,
+    TSS_TABLE_NUM = 2
+};
+
 struct tss_node {
-    struct hash_entry *ht;
-    int tuple[DIM_MAX];
-    int key_bytes;
+    struct tss_key mask;
     int highest_pri;
+    int table;                  /* fixed when the tuple is made */
+    struct tss_table tbl;       /* with TSS_TABLE_OPEN */
+    struct tss_uh_entry *ht;    /* with TSS_TABLE_UTHASH */
+    int tuple[DIM_MAX];
     int tpl_id;
-    TAILQ_ENTRY(tss_node) entry;
+    struct tss_tuple_idx *ix;
+};
+
+#define TSS_BLOOM_BLOCK 512             /* bits, one cache line */
+#define TSS_BLOOM_WORDS (TSS_BLOOM_BLOCK / 64)
+#define TSS_BLOOM_MAX (256 << 10)       /* bytes, to stay in L2 */
+
+/*
+ * a blocked Bloom filter of the keys of all tuples, a key tagged by its
+ * tuple sets 3 bits of one block, so a tuple is skipped or probed after
+ * reading a single cache line. Each bit has a count so keys can be removed.
+ */
+struct tss_bloom {
+    uint64_t *blocks;
+    uint8_t *counts;            /* TSS_BLOOM_BLOCK per block */
+    uint32_t block_mask;        /* blocks - 1 */
+    uint32_t num;               /* keys set */
+};
+
+/* where the tuple of some prefix lengths is */
+struct tss_tuple_idx {
+    int tuple[DIM_MAX];
+    int idx;
+    UT_hash_handle hh;
+};
+
+/*
+ * the tuples in one array sorted by highest_pri, a lookup scans it in
+ * order and stops at the first tuple that cannot beat what it found
+ */
+struct tss_space {
+    struct tss_node *tpls;
+    int num;
+    int cap;
+    int next_id;                /* tpl_id of the next new tuple */
+    int merge;                  /* TupleMerge collision limit, 0 for exact tuples */
+    int bloom;                  /* filter bits per key, 0 for no filter */
+    struct tss_bloom bf;
+    struct tss_tuple_idx *idx;  /* tuple lengths to their place in tpls */
+};
+
+struct tss_conf {
+    int table;          /* hash table of new tuples */
+    int merge;          /* rules a TupleMerge bucket may hold before the
+                           rule gets a tuple of its own lengths, 0 for
+                           exact tuples */
+    int bloom;          /* Bloom filter bits per key, 0 for no filter */
 };
 
-TAILQ_HEAD(tss_head, tss_node);
+extern struct tss_conf tss_conf;
 
-void sort_tss_list(struct tss_head *p_th, struct tss_node *p_l_tn, struct tss_node *p_r_tn);
 int tss_build(const struct rule_set *rs, void *userdata);
+int tss_delete_update(const struct rule_set *rs, void *userdata);
 int tss_classify(const struct packet *pkt, const void *userdata);
+int tss_classify_burst(const struct packet *pkts, int n, int *res, const void *userdata);
 int tss_search(const struct trace *t, const void *userdata);
+void tss_search_stats(const struct trace *t, const void *userdata);
 void tss_cleanup(void *userdata);
 int tss_build_estimate(const struct rule_set *rs, void *userdata);
 int tss_update_estimate(const struct rule_set *rs, const struct rule_set *u_rule_set, void *userdata);